@@ -0,0 +1,183 @@
+/////////////////////////////////////////////////////////////////////
+//          Copyright Yibo Zhu 2017
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+/////////////////////////////////////////////////////////////////////
+#pragma once
+#include "threadpool.h"
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <mutex>
+
+namespace async {
+struct actor_traits {
+  static constexpr unsigned Quota = 64; // max # of messages per drain
+};
+
+// lightweight actor, derive from it and implement receive(), messages are
+// linked in an intrusive mpsc mailbox (Vyukov's design), and the actor is
+// posted to the threadpool only when its mailbox turns from empty to
+// non-empty, so an idle actor costs nothing but its few words of memory.
+// receive() is never called concurrently for the same actor. a drain handles
+// up to Quota messages, then the actor goes back to the end of the pool's
+// queue if there are more, so a busy actor can't hog a worker. call close()
+// before the actor is destroyed (e.g. in the derived class' destructor), it
+// waits until the messages sent are handled, and no drain refers to it
+template <typename Msg, typename TRAITS = actor_traits> class actor {
+  static_assert(TRAITS::Quota > 0, "Quota must be > 0");
+
+public:
+  explicit actor(threadpool &pool)
+      : thpool(&pool), head(&stub), tail(&stub), pending(0) {
+    stub.next.store(nullptr, std::memory_order_relaxed);
+  }
+
+  actor(actor const &) = delete;
+  actor(actor &&) = delete;
+  actor &operator=(actor const &) = delete;
+  actor &operator=(actor &&) = delete;
+
+  virtual ~actor() { // free the undelivered messages
+    for (auto n = pop(); n != nullptr; n = pop())
+      delete n;
+  }
+
+  // called by any thread but the actor's, construct the message in place,
+  // not allowed once close() is called
+  template <typename... Args> void send(Args &&... args) {
+    assert((pending.load(std::memory_order_relaxed) & closing) == 0);
+    auto n = new node(std::forward<Args>(args)...);
+    // count before linking, so a drain never sees more than pending
+    auto empty = pending.fetch_add(1, std::memory_order_acq_rel) == 0;
+    push(n);
+    if (empty)
+      schedule();
+  }
+
+  // # of messages not handled yet
+  size_t backlog() const {
+    return pending.load(std::memory_order_relaxed) & ~closing;
+  }
+
+  // block until the messages sent are handled, and the last drain has
+  // returned, then the actor can be destroyed. not from receive()
+  void close() {
+    if ((pending.fetch_or(closing, std::memory_order_acq_rel) & ~closing) == 0)
+      return; // idle, no drain refers to it
+    auto &c = closer();
+    std::unique_lock<std::mutex> lk(c.mux);
+    c.cv.wait(lk, [this]() {
+      return (pending.load(std::memory_order_acquire) & ~closing) == 0;
+    });
+  }
+
+protected:
+  virtual void receive(Msg &msg) = 0; // exceptions are ignored
+
+private:
+  struct link {
+    std::atomic<link *> next;
+  };
+
+  struct node : link {
+    template <typename... Args>
+    explicit node(Args &&... args) : msg(std::forward<Args>(args)...) {}
+    Msg msg;
+  };
+
+  inline void push(link *n) { // multiple producers
+    n->next.store(nullptr, std::memory_order_relaxed);
+    auto prev = head.exchange(n, std::memory_order_acq_rel);
+    prev->next.store(n, std::memory_order_release);
+  }
+
+  // single consumer, nullptr if empty or the last push isn't linked yet
+  node *pop() {
+    auto t = tail;
+    auto next = t->next.load(std::memory_order_acquire);
+    if (t == &stub) {
+      if (next == nullptr)
+        return nullptr;
+      tail = next;
+      t = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+    if (next != nullptr) {
+      tail = next;
+      return static_cast<node *>(t);
+    }
+    if (t != head.load(std::memory_order_acquire))
+      return nullptr; // a producer is in the middle of push
+    push(&stub);
+    next = t->next.load(std::memory_order_acquire);
+    if (next != nullptr) {
+      tail = next;
+      return static_cast<node *>(t);
+    }
+    return nullptr;
+  }
+
+  void schedule() {
+    thpool->execute([this]() { drain(); });
+  }
+
+  void reschedule() { // behind the others, not in the worker's LIFO slot
+    thpool->defer([this]() { drain(); });
+  }
+
+  void drain() {
+    size_t done(0);
+    for (; done < TRAITS::Quota; ++done) {
+      // empty, or a sender is between counting and linking its message, the
+      // actor is requeued below then, rather than spinning on the worker
+      auto n = pop();
+      if (n == nullptr)
+        break;
+      try {
+        receive(n->msg);
+      } catch (...) {
+      }
+      delete n;
+    }
+    auto cur = pending.load(std::memory_order_acquire);
+    while ((cur & closing) == 0)
+      if (pending.compare_exchange_weak(cur, cur - done,
+                                        std::memory_order_acq_rel,
+                                        std::memory_order_acquire)) {
+        if (cur > done)
+          reschedule(); // more to do, requeue for fairness
+        return;         // idle, not touched anymore
+      }
+    // close() is waiting, it sees the count drop to 0 only once the lock is
+    // released, after which the actor isn't touched anymore
+    auto &c = closer();
+    std::lock_guard<std::mutex> lg(c.mux);
+    if ((pending.fetch_sub(done, std::memory_order_acq_rel) & ~closing) > done)
+      reschedule();
+    else
+      c.cv.notify_all();
+  }
+
+  // shared by the actors being closed, never destroyed, so a drain can use
+  // it after its actor is gone
+  struct closesync {
+    std::mutex mux;
+    std::condition_variable cv;
+  };
+  static closesync &closer() {
+    static closesync *c = new closesync;
+    return *c;
+  }
+
+  // pending's top bit, set by close()
+  static constexpr size_t closing = ~(~static_cast<size_t>(0) >> 1);
+
+  threadpool *const thpool;
+  std::atomic<link *> head; // producers' end
+  link *tail;               // consumer's end
+  link stub;
+  std::atomic<size_t> pending; // # of messages sent but not handled
+};
+} // namespace async
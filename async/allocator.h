@@ -0,0 +1,123 @@
+/////////////////////////////////////////////////////////////////////
+//          Copyright Yibo Zhu 2017
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+/////////////////////////////////////////////////////////////////////
+#pragma once
+#include "vmem.h"
+#include <algorithm>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <vector>
+
+namespace async {
+// allocators of the queues' storage, plugged in by the traits (allocator).
+// a queue keeps an instance, default constructed or given to its
+// constructor, and makes all its allocations through it. an allocator is
+// copyable and provides (static if it's stateless):
+//   void *allocate(size_t bytes, size_t align); // throw bad_alloc
+//   void deallocate(void *ptr, size_t bytes, size_t align);
+//   static constexpr bool hugepages; // advise huge pages on reservations
+// align must not exceed the page size
+
+// page aligned mappings for blocks of a page or more (so they can be
+// trimmed), the heap for the smaller ones
+struct default_allocator {
+  static constexpr bool hugepages = false;
+  static void *allocate(size_t bytes, size_t align) {
+    if (mapped(bytes, align))
+      return vmem::allocate(bytes);
+    return ::operator new(bytes);
+  }
+  static void deallocate(void *ptr, size_t bytes, size_t align) noexcept {
+    if (mapped(bytes, align))
+      vmem::deallocate(ptr, bytes);
+    else
+      ::operator delete(ptr);
+  }
+
+private:
+  static inline bool mapped(size_t bytes, size_t align) {
+    return bytes >= vmem::page_size() || align > alignof(std::max_align_t);
+  }
+};
+
+// huge pages (2MB) to cut the dTLB misses of large queues, blocks of half a
+// huge page or more are mapped on their own, the smaller ones are carved
+// from shared huge pages (size-class free lists, the huge pages are kept
+// for the life of the process). falls back to transparent huge pages, then
+// to normal pages. with Lock, the pages are mlock-ed if allowed
+template <bool Lock = false> struct basic_hugepage_allocator {
+  static constexpr bool hugepages = true;
+  static void *allocate(size_t bytes, size_t align) {
+    if (bytes >= vmem::huge_page_size() / 2) {
+      auto ptr = vmem::allocate_huge(bytes);
+      if (Lock)
+        vmem::lock(ptr, bytes);
+      return ptr;
+    }
+    return carve(roundup(bytes, align), align);
+  }
+  static void deallocate(void *ptr, size_t bytes, size_t align) noexcept {
+    if (bytes >= vmem::huge_page_size() / 2) {
+      vmem::deallocate_huge(ptr, bytes);
+      return;
+    }
+    auto &a = getarena();
+    std::lock_guard<std::mutex> lg(a.mux);
+    try {
+      a.freelists[roundup(bytes, align)].push_back(ptr);
+    } catch (...) { // leaked, no memory for the free list
+    }
+  }
+
+private:
+  struct arena {
+    std::mutex mux;
+    char *cur = nullptr;
+    size_t left = 0;
+    std::unordered_map<size_t, std::vector<void *>> freelists;
+  };
+
+  static arena &getarena() {
+    static arena *a = new arena; // never destroyed, static queues may
+    return *a;                   // deallocate after exit
+  }
+
+  static inline size_t roundup(size_t bytes, size_t align) {
+    align = std::max(align, alignof(std::max_align_t));
+    return (bytes + align - 1) / align * align;
+  }
+
+  static void *carve(size_t bytes, size_t align) {
+    auto &a = getarena();
+    std::lock_guard<std::mutex> lg(a.mux);
+    auto it = a.freelists.find(bytes);
+    if (it != a.freelists.end() && !it->second.empty()) {
+      auto ptr = it->second.back();
+      it->second.pop_back();
+      return ptr;
+    }
+    align = std::max(align, alignof(std::max_align_t));
+    auto pad = (align - reinterpret_cast<uintptr_t>(a.cur) % align) % align;
+    if (a.cur == nullptr || a.left < pad + bytes) { // the rest is wasted
+      auto huge = vmem::huge_page_size();
+      a.cur = static_cast<char *>(vmem::allocate_huge(huge));
+      if (Lock)
+        vmem::lock(a.cur, huge);
+      a.left = huge;
+      pad = 0;
+    }
+    auto ptr = a.cur + pad;
+    a.cur += pad + bytes;
+    a.left -= pad + bytes;
+    return ptr;
+  }
+};
+
+using hugepage_allocator = basic_hugepage_allocator<false>;
+using locked_hugepage_allocator = basic_hugepage_allocator<true>;
+} // namespace async
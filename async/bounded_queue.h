@@ -7,53 +7,156 @@
 
 #pragma once
 
+#include "allocator.h"
+#include "eventcount.h"
 #include "utility.h"
 #include <atomic>
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <climits>
+#include <cstring>
 #include <limits>
+#include <type_traits>
 
 namespace async {
 
+// how the slots of a bounded_queue's ring are laid out (TRAITS::SlotLayout)
+enum class slot_layout : uint8_t {
+  packed, // slots next to each other, small slots share cache lines
+  padded, // each slot on its own cache line(s), at the cost of memory
+  spread  // packed, but consecutive tickets go to slots on different lines
+};
+
 struct bounded_traits {
   static constexpr bool NOEXCEPT_CHECK = false; // exception handling flag
   static constexpr size_t CachelineSize = 64;
   using sequence_type = uint64_t;
+  using allocator = default_allocator; // of the ring, see allocator.h
+  // enqueues/dequeues wake up the threads sleeping in wait_*(), which need
+  // it, at the cost of a full fence per operation, paid even while nobody
+  // waits (an uncontended enqueue/dequeue pair takes about twice as long)
+  static constexpr bool Waitable = false;
+  // spread needs a capacity which is a multiple of the # of slots per cache
+  // line, the ring is packed otherwise
+  static constexpr slot_layout SlotLayout = slot_layout::packed;
+  // lossy ring: enqueues never fail, a full ring overwrites its oldest
+  // element, which the consumers skip (counted by dropped()). for the
+  // enqueues, dequeue and the wait_*() ones, needs !NOEXCEPT_CHECK
+  static constexpr bool Overwrite = false;
 };
 
-template <typename T, typename TRAITS = bounded_traits> class bounded_queue {
+template <typename T, typename TRAITS> class resizable_bounded_queue;
+
+// a sequence # to its slot and ticket in a ring of size slots, by a mask and
+// a shift if size is a power of 2, by divisions otherwise
+template <typename seq_t> struct ringmodulo {
+  explicit ringmodulo(size_t size)
+      : fastmodulo((size > 0 && ((size & (size - 1)) == 0))),
+        bitshift(fastmodulo ? getShiftBitsCount(size) : 0),
+        mask(fastmodulo ? size - 1 : 0), qsize(size) {}
+  inline seq_t slot(seq_t const seq) const {
+    if (fastmodulo)
+      return seq & mask;
+    else
+      return seq >= qsize ? seq % qsize : seq;
+  }
+  inline seq_t ticket(seq_t const seq) const {
+    if (fastmodulo)
+      return (seq >> bitshift) << 1;
+    else
+      return (seq / static_cast<seq_t>(qsize)) << 1;
+  }
+  bool fastmodulo; // true if qsize is power of 2
+  int bitshift;    // used if fastmodulo is true
+  size_t mask;     // used if fastmodulo is true
+  size_t qsize;    // queue size
+};
+
+// claim the slot of the next ticket of ix (0: enqueue, 1: dequeue offset),
+// nullptr if the ring is full (empty). ring.slotof(seq) is the slot of a
+// sequence #, holding its ticket in tkt, ring.ticket(seq) the ticket
+template <typename seq_t, typename RING>
+inline auto claimticket(RING &ring, std::atomic<seq_t> &ix, seq_t offset,
+                        seq_t &tkt) noexcept -> decltype(&ring.slotof(0)) {
+  auto idx = ix.load(std::memory_order_acquire);
+  for (;;) {
+    auto &slot = ring.slotof(idx);
+    seq_t cur = slot.tkt.load(std::memory_order_acquire);
+    seq_t want = ring.ticket(idx) + offset;
+    seq_t diff = cur - want;
+    if (diff == 0) {
+      if (ix.compare_exchange_strong(idx, idx + 1, std::memory_order_acq_rel,
+                                     std::memory_order_relaxed)) {
+        tkt = want;
+        return &slot;
+      }
+    } else if (diff >= std::numeric_limits<seq_t>::max() / 2)
+      return nullptr;
+    else
+      idx = ix.load(std::memory_order_acquire);
+  }
+}
+
+// Capacity > 0: the ring is embedded, and indexed with compile time
+// constants (see static_bounded_queue), 0: it's allocated at construction
+template <typename T, typename TRAITS = bounded_traits, size_t Capacity = 0>
+class basic_bounded_queue {
 private:
   static_assert(std::is_nothrow_destructible<T>::value,
                 "T must be nothrow destructible");
+  static_assert(!TRAITS::Overwrite || !TRAITS::NOEXCEPT_CHECK,
+                "Overwrite can't skip the elements which failed to construct");
 
 public:
   static constexpr size_t cacheline_size = TRAITS::CachelineSize;
   using seq_t = typename TRAITS::sequence_type;
-  explicit bounded_queue(size_t size)
-      : fastmodulo((size > 0 && ((size & (size - 1)) == 0))),
-        bitshift(fastmodulo ? getShiftBitsCount(size) : 0),
-        elements(new element[size]), mask(fastmodulo ? size - 1 : 0),
-        qsize(size), enqueueIx(0), dequeueIx(0) {
-    assert(qsize > 0); // any size <= 0 is illegal
+  using allocator = typename TRAITS::allocator;
+  // the ring is allocated through a
+  template <size_t C = Capacity,
+            typename = typename std::enable_if<(C == 0)>::type>
+  explicit basic_bounded_queue(size_t size, allocator const &a = allocator())
+      : ring(size, a), enqueueIx(0), droppedcount(0), dequeueIx(0),
+        closedflag(false), sealpos(npos) {
+    assert(size > 0); // any size <= 0 is illegal
+  }
+  // the ring is embedded, no size, no allocator
+  template <size_t C = Capacity,
+            typename = typename std::enable_if<(C > 0)>::type>
+  basic_bounded_queue()
+      : ring(C, allocator()), enqueueIx(0), droppedcount(0), dequeueIx(0),
+        closedflag(false), sealpos(npos) {}
+  basic_bounded_queue(basic_bounded_queue const &) = delete;
+  basic_bounded_queue(basic_bounded_queue &&) = delete;
+  basic_bounded_queue &operator=(basic_bounded_queue const &) = delete;
+  basic_bounded_queue &operator=(basic_bounded_queue &&) = delete;
+  size_t size() { return ring.size(); }
+
+  // # of elements overwritten before they were dequeued (TRAITS::Overwrite)
+  seq_t dropped() const noexcept {
+    return droppedcount.load(std::memory_order_relaxed);
   }
-  bounded_queue(bounded_queue const &) = delete;
-  bounded_queue(bounded_queue &&) = delete;
-  bounded_queue &operator=(bounded_queue const &) = delete;
-  bounded_queue &operator=(bounded_queue &&) = delete;
-  ~bounded_queue() { delete[] elements; }
-  size_t size() { return qsize; }
 
   template <typename... Args, // NON-SAFE
             typename = typename std::enable_if<
                 !TRAITS::NOEXCEPT_CHECK ||
                 std::is_nothrow_constructible<T, Args &&...>::value>::type>
   inline void blocking_enqueue(Args &&... args) noexcept {
+    if (TRAITS::Overwrite) {
+      overwrite(std::forward<Args>(args)...);
+      return;
+    }
     auto enqidx = enqueueIx.fetch_add(1, std::memory_order_acq_rel);
-    auto &ele = elements[index(enqidx)];
+    auto &ele = ring.elements[index(enqidx)];
     auto enq_tkt = ticket(enqidx);
+    backoff bo;
     while (enq_tkt != ele.tkt.load(std::memory_order_acquire))
-      continue;
+      bo.pause();
     ele.construct(std::forward<Args>(args)...);
+    if (TRAITS::NOEXCEPT_CHECK) // read by bulk & zero-copy consumers
+      ele.hasdata.store(true, std::memory_order_relaxed);
     ele.tkt.store(enq_tkt + 1, std::memory_order_release);
+    notify(notempty);
   }
 
   template <typename... Args, // SAFE-IMPL
@@ -62,17 +165,20 @@ public:
                 !std::is_nothrow_constructible<T, Args &&...>::value>::type>
   inline bool blocking_enqueue(Args &&... args) noexcept {
     auto enqidx = enqueueIx.fetch_add(1, std::memory_order_acq_rel);
-    auto &ele = elements[index(enqidx)];
+    auto &ele = ring.elements[index(enqidx)];
     auto enq_tkt = ticket(enqidx);
+    backoff bo;
     while (enq_tkt != ele.tkt.load(std::memory_order_acquire))
-      continue;
+      bo.pause();
     if (ele.construct(std::forward<Args>(args)...)) {
       ele.hasdata.store(true, std::memory_order_release);
       ele.tkt.store(enq_tkt + 1, std::memory_order_release);
+      notify(notempty);
       return true;
     } else {
       ele.hasdata.store(false, std::memory_order_release);
       ele.tkt.store(enq_tkt + 1, std::memory_order_release);
+      notify(notempty);
       return false;
     }
   }
@@ -83,9 +189,13 @@ public:
                     std::is_nothrow_constructible<T, Args &&...>::value,
                 int>::type = 0>
   inline bool enqueue(Args &&... args) noexcept {
+    if (TRAITS::Overwrite) {
+      overwrite(std::forward<Args>(args)...);
+      return true;
+    }
     auto enqidx = enqueueIx.load(std::memory_order_acquire);
     for (;;) {
-      auto &ele = elements[index(enqidx)];
+      auto &ele = ring.elements[index(enqidx)];
       seq_t tkt = ele.tkt.load(std::memory_order_acquire);
       seq_t enq_tkt = ticket(enqidx);
       seq_t diff = tkt - enq_tkt;
@@ -94,7 +204,10 @@ public:
                                               std::memory_order_release,
                                               std::memory_order_relaxed)) {
           ele.construct(std::forward<Args>(args)...);
+          if (TRAITS::NOEXCEPT_CHECK)
+            ele.hasdata.store(true, std::memory_order_relaxed);
           ele.tkt.store(enq_tkt + 1, std::memory_order_release);
+          notify(notempty);
           return true;
         }
       } else if (diff >= std::numeric_limits<seq_t>::max() / 2)
@@ -112,7 +225,7 @@ public:
   inline bool enqueue(Args &&... args) noexcept {
     auto enqidx = enqueueIx.load(std::memory_order_relaxed);
     for (;;) {
-      auto &ele = elements[index(enqidx)];
+      auto &ele = ring.elements[index(enqidx)];
       seq_t tkt = ele.tkt.load(std::memory_order_acquire);
       seq_t enq_tkt = ticket(enqidx);
       seq_t diff = tkt - enq_tkt;
@@ -123,10 +236,12 @@ public:
           if (ele.construct(std::forward<Args>(args)...)) {
             ele.hasdata.store(true, std::memory_order_release);
             ele.tkt.store(enq_tkt + 1, std::memory_order_release);
+            notify(notempty);
             return true;
           } else {
             ele.hasdata.store(false, std::memory_order_release);
             ele.tkt.store(enq_tkt + 1, std::memory_order_release);
+            notify(notempty);
             return false;
           }
         }
@@ -142,13 +257,17 @@ public:
                 !TRAITS::NOEXCEPT_CHECK ||
                 std::is_nothrow_constructible<U>::value>::type>
   inline void blocking_dequeue(U &data) noexcept {
+    static_assert(!TRAITS::Overwrite, "blocking_dequeue can't skip, use "
+                                      "wait_dequeue in Overwrite mode");
     auto deqidx = dequeueIx.fetch_add(1, std::memory_order_acq_rel);
-    auto &ele = elements[index(deqidx)];
+    auto &ele = ring.elements[index(deqidx)];
     seq_t deq_tkt = ticket(deqidx) + 1;
+    backoff bo;
     while (deq_tkt != ele.tkt.load(std::memory_order_acquire))
-      continue;
+      bo.pause();
     ele.move(data);
     ele.tkt.store(deq_tkt + 1, std::memory_order_release);
+    notify(notfull);
   }
 
   template <typename U = T, // SAFE-IMPL
@@ -157,16 +276,19 @@ public:
                 !std::is_nothrow_constructible<U>::value>::type>
   inline bool blocking_dequeue(U &data) noexcept {
     auto deqidx = dequeueIx.fetch_add(1, std::memory_order_acq_rel);
-    auto &ele = elements[index(deqidx)];
+    auto &ele = ring.elements[index(deqidx)];
     seq_t deq_tkt = ticket(deqidx) + 1;
+    backoff bo;
     while (deq_tkt != ele.tkt.load(std::memory_order_acquire))
-      continue;
+      bo.pause();
     if (ele.hasdata.load(std::memory_order_acquire)) {
       ele.move(data);
       ele.tkt.store(deq_tkt + 1, std::memory_order_release);
+      notify(notfull);
       return true;
     } else {
       ele.tkt.store(deq_tkt + 1, std::memory_order_release);
+      notify(notfull);
       return false;
     }
   }
@@ -176,10 +298,11 @@ public:
                                         std::is_nothrow_constructible<U>::value,
                                     int>::type = 0>
   inline bool dequeue(U &data) {
-
+    if (TRAITS::Overwrite)
+      return dequeueoldest(data);
     auto deqidx = dequeueIx.load(std::memory_order_acquire);
     for (;;) {
-      auto &ele = elements[index(deqidx)];
+      auto &ele = ring.elements[index(deqidx)];
       seq_t tkt = ele.tkt.load(std::memory_order_acquire);
       seq_t deq_tkt = ticket(deqidx) + 1;
       seq_t diff = tkt - deq_tkt;
@@ -189,6 +312,7 @@ public:
                                               std::memory_order_relaxed)) {
           ele.move(data);
           ele.tkt.store(deq_tkt + 1, std::memory_order_release);
+          notify(notfull);
           return true;
         }
       } else if (diff >= std::numeric_limits<seq_t>::max() / 2)
@@ -211,7 +335,7 @@ public:
 
     auto deqidx = dequeueIx.load(std::memory_order_acquire);
     for (;;) {
-      auto &ele = elements[index(deqidx)];
+      auto &ele = ring.elements[index(deqidx)];
       seq_t tkt = ele.tkt.load(std::memory_order_acquire);
       seq_t deq_tkt = ticket(deqidx) + 1;
       seq_t diff = tkt - deq_tkt;
@@ -222,9 +346,11 @@ public:
           if (ele.hasdata.load(std::memory_order_acquire)) {
             ele.move(data);
             ele.tkt.store(deq_tkt + 1, std::memory_order_release);
+            notify(notfull);
             return true;
           } else {
             ele.tkt.store(deq_tkt + 1, std::memory_order_release);
+            notify(notfull);
             return false;
           }
         }
@@ -236,20 +362,393 @@ public:
     }
   }
 
+  // block until an element is dequeued, spinning a while before sleeping.
+  // false if the queue is closed and drained (needs TRAITS::Waitable)
+  template <typename U = T> bool wait_dequeue(U &data) {
+    static_assert(TRAITS::Waitable, "wait_dequeue needs TRAITS::Waitable");
+    return notempty.await([&]() { return dequeue(data); },
+                          [this]() { return closed(); }) ==
+           wait_status::ready;
+  }
+
+  template <typename U, typename Rep, typename Period>
+  wait_status wait_dequeue_for(U &data,
+                               std::chrono::duration<Rep, Period> const &timeout) {
+    static_assert(TRAITS::Waitable, "wait_dequeue_for needs TRAITS::Waitable");
+    return notempty.await_until([&]() { return dequeue(data); },
+                                [this]() { return closed(); },
+                                std::chrono::steady_clock::now() + timeout);
+  }
+
+  // wait for a free slot, closed if the queue is closed (nothing enqueued)
+  template <typename Rep, typename Period, typename... Args, // NON-SAFE
+            typename = typename std::enable_if<
+                !TRAITS::NOEXCEPT_CHECK ||
+                std::is_nothrow_constructible<T, Args &&...>::value>::type>
+  wait_status wait_enqueue_for(std::chrono::duration<Rep, Period> const &timeout,
+                               Args &&... args) {
+    static_assert(TRAITS::Waitable, "wait_enqueue_for needs TRAITS::Waitable");
+    // args are consumed only by the enqueue which succeeds
+    bool done(false);
+    auto status = notfull.await_until(
+        [&]() {
+          return !closed() &&
+                 (done = enqueue(std::forward<Args>(args)...));
+        },
+        [this]() { return closed(); },
+        std::chrono::steady_clock::now() + timeout);
+    return done ? wait_status::ready : status;
+  }
+
+  // wake up all the waiting threads, wait_dequeue*() report closed once the
+  // queue is drained, wait_enqueue_for() right away. enqueue() and
+  // blocking_enqueue() are still allowed, it's up to the caller
+  void close() noexcept {
+    closedflag.store(true, std::memory_order_seq_cst);
+    notempty.notify_all();
+    notfull.notify_all();
+  }
+  bool closed() const noexcept {
+    return closedflag.load(std::memory_order_seq_cst);
+  }
+
 private:
-  inline seq_t index(seq_t const seq) {
-    if (fastmodulo)
-      return seq & mask;
-    else
-      return seq >= qsize ? seq % qsize : seq;
+  struct element;
+
+public:
+  // zero-copy access to a slot of the ring, returned by try_claim(), the
+  // element is written in place, and handed over to the consumers by
+  // publish(), or when the slot is destroyed (a claimed slot can't be given
+  // back). empty if the queue was full
+  class write_slot {
+  public:
+    write_slot() noexcept : q(nullptr), ele(nullptr), tkt(0) {}
+    write_slot(write_slot &&other) noexcept
+        : q(other.q), ele(other.ele), tkt(other.tkt) {
+      other.ele = nullptr;
+    }
+    write_slot &operator=(write_slot &&other) noexcept {
+      if (this != &other) {
+        publish();
+        q = other.q;
+        ele = other.ele;
+        tkt = other.tkt;
+        other.ele = nullptr;
+      }
+      return *this;
+    }
+    ~write_slot() { publish(); }
+    explicit operator bool() const noexcept { return ele != nullptr; }
+    T &operator*() const noexcept { return *ele->getptr(); }
+    T *operator->() const noexcept { return ele->getptr(); }
+    void publish() noexcept {
+      if (ele == nullptr)
+        return;
+      if (TRAITS::NOEXCEPT_CHECK)
+        ele->hasdata.store(true, std::memory_order_relaxed);
+      ele->tkt.store(tkt + 1, std::memory_order_release);
+      q->notify(q->notempty);
+      ele = nullptr;
+    }
+
+  private:
+    friend class basic_bounded_queue;
+    write_slot(basic_bounded_queue *queue, element *e, seq_t t) noexcept
+        : q(queue), ele(e), tkt(t) {}
+    basic_bounded_queue *q;
+    element *ele;
+    seq_t tkt;
+  };
+
+  // zero-copy access to an element in the ring, returned by try_consume(),
+  // the element is read in place, and destroyed by release(), or when the
+  // slot is destroyed, which frees the slot for the producers. empty if the
+  // queue was empty
+  class read_slot {
+  public:
+    read_slot() noexcept : q(nullptr), ele(nullptr), tkt(0) {}
+    read_slot(read_slot &&other) noexcept
+        : q(other.q), ele(other.ele), tkt(other.tkt) {
+      other.ele = nullptr;
+    }
+    read_slot &operator=(read_slot &&other) noexcept {
+      if (this != &other) {
+        release();
+        q = other.q;
+        ele = other.ele;
+        tkt = other.tkt;
+        other.ele = nullptr;
+      }
+      return *this;
+    }
+    ~read_slot() { release(); }
+    explicit operator bool() const noexcept { return ele != nullptr; }
+    T &operator*() const noexcept { return *ele->getptr(); }
+    T *operator->() const noexcept { return ele->getptr(); }
+    void release() noexcept {
+      if (ele == nullptr)
+        return;
+      ele->destruct();
+      ele->tkt.store(tkt + 1, std::memory_order_release);
+      q->notify(q->notfull);
+      ele = nullptr;
+    }
+
+  private:
+    friend class basic_bounded_queue;
+    read_slot(basic_bounded_queue *queue, element *e, seq_t t) noexcept
+        : q(queue), ele(e), tkt(t) {}
+    basic_bounded_queue *q;
+    element *ele;
+    seq_t tkt;
+  };
+
+  // claim a slot for an element constructed in place from args, or left
+  // default-initialized without args (uninitialized for trivial T), so it
+  // can be filled field by field
+  template <typename... Args, // NON-SAFE
+            typename = typename std::enable_if<
+                !TRAITS::NOEXCEPT_CHECK ||
+                std::is_nothrow_constructible<T, Args &&...>::value>::type>
+  inline write_slot try_claim(Args &&... args) noexcept {
+    static_assert(!TRAITS::Overwrite, "not available in Overwrite mode");
+    seq_t tkt(0);
+    auto ele = claimslot(enqueueIx, 0, tkt);
+    if (ele == nullptr)
+      return write_slot(); // queue is full
+    ele->initialize(std::forward<Args>(args)...);
+    return write_slot(this, ele, tkt);
   }
 
-  inline seq_t ticket(seq_t const seq) {
-    if (fastmodulo)
-      return (seq >> bitshift) << 1;
-    else
-      return (seq / static_cast<seq_t>(qsize)) << 1;
+  inline read_slot try_consume() noexcept {
+    static_assert(!TRAITS::Overwrite, "not available in Overwrite mode");
+    seq_t tkt(0);
+    for (;;) {
+      auto ele = claimslot(dequeueIx, 1, tkt);
+      if (ele == nullptr)
+        return read_slot(); // queue is empty
+      if (!TRAITS::NOEXCEPT_CHECK ||
+          ele->hasdata.load(std::memory_order_acquire))
+        return read_slot(this, ele, tkt);
+      ele->tkt.store(tkt + 1, std::memory_order_release); // invalid, skip it
+      notify(notfull);
+    }
   }
+
+  // enqueue up to count elements from it, in order, the free slots ahead
+  // are claimed with one CAS on enqueueIx. returns the # of elements taken
+  // from it, < count if the queue got full. with TRAITS::NOEXCEPT_CHECK, an
+  // element whose constructor throws is taken, but skipped by the consumers
+  template <typename IT> size_t try_enqueue_bulk(IT it, size_t count) noexcept {
+    static_assert(!TRAITS::Overwrite, "not available in Overwrite mode");
+    count = std::min(count, size());
+    for (;;) {
+      auto enqidx = enqueueIx.load(std::memory_order_acquire);
+      size_t n(0);
+      for (; n < count; ++n) { // free slots stay free until claimed
+        auto idx = enqidx + n;
+        if (ring.elements[index(idx)].tkt.load(std::memory_order_acquire) !=
+            ticket(idx))
+          break;
+      }
+      if (n == 0)
+        return 0; // queue is full
+      if (!enqueueIx.compare_exchange_weak(enqidx, enqidx + n,
+                                           std::memory_order_acq_rel,
+                                           std::memory_order_relaxed))
+        continue;
+      for (size_t i = 0; i < n; ++i, ++it) {
+        auto idx = enqidx + i;
+        auto &ele = ring.elements[index(idx)];
+        if (TRAITS::NOEXCEPT_CHECK) {
+          try {
+            ele.initialize(*it);
+            ele.hasdata.store(true, std::memory_order_relaxed);
+          } catch (...) {
+            ele.hasdata.store(false, std::memory_order_relaxed);
+          }
+        } else {
+          ele.initialize(*it);
+        }
+        ele.tkt.store(ticket(idx) + 1, std::memory_order_release);
+      }
+      if (TRAITS::Waitable)
+        notempty.notify_all();
+      return n;
+    }
+  }
+
+  // dequeue up to maxcount elements into it, in order, the published slots
+  // ahead are claimed with one CAS on dequeueIx. returns the # of elements
+  // dequeued, < maxcount if the queue got empty
+  template <typename IT> size_t try_dequeue_bulk(IT it, size_t maxcount) {
+    static_assert(!TRAITS::Overwrite, "not available in Overwrite mode");
+    maxcount = std::min(maxcount, size());
+    for (;;) {
+      auto deqidx = dequeueIx.load(std::memory_order_acquire);
+      size_t n(0);
+      for (; n < maxcount; ++n) { // published slots wait for their ticket
+        auto idx = deqidx + n;
+        if (ring.elements[index(idx)].tkt.load(std::memory_order_acquire) !=
+            ticket(idx) + 1)
+          break;
+      }
+      if (n == 0)
+        return 0; // queue is empty
+      if (!dequeueIx.compare_exchange_weak(deqidx, deqidx + n,
+                                           std::memory_order_acq_rel,
+                                           std::memory_order_relaxed))
+        continue;
+      size_t count(0);
+      for (size_t i = 0; i < n; ++i) {
+        auto idx = deqidx + i;
+        auto &ele = ring.elements[index(idx)];
+        if (!TRAITS::NOEXCEPT_CHECK ||
+            ele.hasdata.load(std::memory_order_acquire)) {
+          ele.move(*it);
+          ++it;
+          ++count;
+        }
+        ele.tkt.store(ticket(idx) + 2, std::memory_order_release);
+      }
+      if (TRAITS::Waitable)
+        notfull.notify_all();
+      if (count > 0)
+        return count;
+    }
+  }
+
+private:
+  template <typename, typename> friend class resizable_bounded_queue;
+  static constexpr seq_t npos = static_cast<seq_t>(-1);
+  static constexpr seq_t sealoffset = static_cast<seq_t>(1)
+                                      << (sizeof(seq_t) * CHAR_BIT - 2);
+
+  // stop the enqueues (resizable_bounded_queue): enqueueIx jumps a quarter
+  // of the sequence space ahead, whose tickets are never ready
+  void seal() noexcept {
+    auto pos = enqueueIx.fetch_add(sealoffset, std::memory_order_acq_rel);
+    sealpos.store(pos, std::memory_order_release);
+  }
+
+  // sealed, and each element claimed by a consumer
+  bool drained() noexcept {
+    auto pos = sealpos.load(std::memory_order_acquire);
+    return pos != npos && dequeueIx.load(std::memory_order_acquire) == pos;
+  }
+
+  // claim the slot of the next ticket of ix (0: enqueue, 1: dequeue
+  // offset), nullptr if the queue is full (empty)
+  inline element *claimslot(std::atomic<seq_t> &ix, seq_t offset,
+                            seq_t &tkt) noexcept {
+    return claimticket(ring, ix, offset, tkt);
+  }
+
+  // Overwrite mode, a slot's ticket is even if empty, odd if it holds the
+  // element of ticket - 1, with the busy bit while an element is written (on
+  // the even ticket of the producer) or moved out (on the odd ticket of the
+  // element). producers take their ticket with a fetch_add, and never wait
+  // for the consumers, but for a consumer moving the element out of their
+  // slot, or for a producer a lap behind still writing it. a trivially
+  // copyable T is copied out without the busy bit, and the copy is validated
+  // by moving the ticket on (seqlock), so the producers don't wait for the
+  // consumers at all. the consumers skip the busy slots
+  static constexpr seq_t busy = static_cast<seq_t>(1)
+                                << (sizeof(seq_t) * CHAR_BIT - 1);
+  static constexpr bool seqlocked = std::is_trivially_copyable<T>::value;
+
+  template <typename... Args> inline void overwrite(Args &&... args) noexcept {
+    auto enqidx = enqueueIx.fetch_add(1, std::memory_order_acq_rel);
+    auto &ele = ring.elements[index(enqidx)];
+    seq_t want = ticket(enqidx);
+    seq_t cur = ele.tkt.load(std::memory_order_acquire);
+    backoff bo;
+    for (;;) {
+      if ((cur & ~busy) > want) {
+        // lapped by a later producer, this element is the oldest one
+        droppedcount.fetch_add(1, std::memory_order_relaxed);
+        return;
+      } else if (cur & busy) { // the element of the previous lap is moving
+        bo.pause();
+        cur = ele.tkt.load(std::memory_order_acquire);
+      } else if (ele.tkt.compare_exchange_weak(cur, want | busy,
+                                               std::memory_order_acquire,
+                                               std::memory_order_acquire))
+        break;
+    }
+    if (cur & 1) { // not dequeued, overwritten
+      ele.destruct();
+      droppedcount.fetch_add(1, std::memory_order_relaxed);
+    }
+    ele.construct(std::forward<Args>(args)...);
+    ele.tkt.store(want + 1, std::memory_order_release);
+    notify(notempty);
+  }
+
+  // dequeue the oldest element still in the ring, the slots overwritten
+  // since dequeueIx was moved there, or taken by another consumer, are
+  // skipped
+  template <typename U> inline bool dequeueoldest(U &data) {
+    for (;;) {
+      auto deqidx = dequeueIx.load(std::memory_order_acquire);
+      auto &ele = ring.elements[index(deqidx)];
+      seq_t want = ticket(deqidx) + 1;
+      seq_t cur = ele.tkt.load(std::memory_order_acquire);
+      seq_t tkt = cur & ~busy;
+      if (tkt < want)
+        return false; // queue is empty, or its element is being written
+      if (tkt == want && !(cur & busy) && take(ele, want, data)) {
+        dequeueIx.compare_exchange_strong(deqidx, deqidx + 1,
+                                          std::memory_order_acq_rel,
+                                          std::memory_order_relaxed);
+        notify(notfull);
+        return true;
+      }
+      if (tkt == want) { // taken by another consumer, or overwritten
+        dequeueIx.compare_exchange_strong(deqidx, deqidx + 1,
+                                          std::memory_order_acq_rel,
+                                          std::memory_order_relaxed);
+        continue;
+      }
+      // dequeued by another consumer, or overwritten: go on from the oldest
+      // ticket which can still be in the ring
+      auto enqidx = enqueueIx.load(std::memory_order_acquire);
+      auto next = enqidx - deqidx > size() ? enqidx - size() : deqidx + 1;
+      dequeueIx.compare_exchange_strong(deqidx, next, std::memory_order_acq_rel,
+                                        std::memory_order_relaxed);
+    }
+  }
+
+  // take the element of ticket want - 1 out of ele, false if it's been
+  // taken by another consumer or overwritten meanwhile
+  template <typename U> inline bool take(element &ele, seq_t want, U &data) {
+    if (seqlocked) {
+      decltype(ele.storage) copy;
+      std::memcpy(&copy, &ele.storage, sizeof(copy));
+      // the copy is whole if the ticket hasn't moved while it was made
+      if (!ele.tkt.compare_exchange_strong(want, want + 1,
+                                           std::memory_order_acq_rel,
+                                           std::memory_order_relaxed))
+        return false;
+      data = std::move(*reinterpret_cast<T *>(&copy));
+      return true;
+    }
+    if (!ele.tkt.compare_exchange_strong(want, want | busy,
+                                         std::memory_order_acquire,
+                                         std::memory_order_relaxed))
+      return false;
+    ele.move(data);
+    ele.tkt.store(want + 1, std::memory_order_release);
+    return true;
+  }
+
+  static inline void notify(eventcount &ec) noexcept {
+    if (TRAITS::Waitable)
+      ec.notify_one();
+  }
+
+  inline seq_t index(seq_t const seq) { return ring.index(seq); }
+  inline seq_t ticket(seq_t const seq) { return ring.ticket(seq); }
   //TODO& Review: replace the following with c++ concepts
   template <typename U = T, typename Enable = void> struct checkdata {};
 
@@ -266,6 +765,12 @@ private:
     std::atomic<bool> hasdata;
   };
 
+  static constexpr size_t slotalign =
+      TRAITS::SlotLayout == slot_layout::padded &&
+              TRAITS::CachelineSize > alignof(std::atomic<seq_t>)
+          ? TRAITS::CachelineSize
+          : alignof(std::atomic<seq_t>);
+
   struct element : public checkdata<T> {
     element() : tkt(0) {}
     ~element() {
@@ -294,6 +799,11 @@ private:
       return true;
     }
 
+    template <typename... Args> inline void initialize(Args &&... args) {
+      new (&storage) T(std::forward<Args>(args)...);
+    }
+    inline void initialize() { new (&storage) T; } // default-initialized
+
     inline void destruct() noexcept { reinterpret_cast<T *>(&storage)->~T(); }
 
     inline T *getptr() { return reinterpret_cast<T *>(&storage); }
@@ -321,20 +831,113 @@ private:
       destruct();
     }
 
-    std::atomic<seq_t> tkt;
+    alignas(slotalign) std::atomic<seq_t> tkt;
     typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
     std::atomic<bool> hasdata;
   };
 
-  bool const fastmodulo;   // true if qsize is power of 2
-  int const bitshift;      // used if fastmodulo is true
-  element *const elements; // pointer to buffer
-  size_t const mask;       // used if fastmodulo is true
-  size_t const qsize;      // queue size
+  static constexpr size_t slotsperline =
+      sizeof(element) >= cacheline_size ? 1 : cacheline_size / sizeof(element);
+  static constexpr bool spreading =
+      TRAITS::SlotLayout == slot_layout::spread && slotsperline > 1;
+
+  // # of cache lines to spread the slots over, 0 if they can't be spread.
+  // there must be at least as many lines as slots per line, so a line holds
+  // no tickets closer than lines
+  static constexpr size_t spreadlines(size_t size) {
+    return spreading && size % slotsperline == 0 &&
+                   size / slotsperline >= slotsperline
+               ? size / slotsperline
+               : 0;
+  }
+
+  // ticket k goes to line k % lines, so k + 1 is on the next line, and the
+  // tickets sharing a line are lines apart, a bijection of the ring as the
+  // lines are full
+  static inline seq_t spread(seq_t const k, seq_t const lines) {
+    if (!spreading || lines == 0)
+      return k;
+    return (k % lines) * slotsperline + k / lines;
+  }
+
+  // the ring starts on a cache line if spreading, so its lines are the
+  // hardware ones
+  static constexpr size_t ringalign =
+      spreading && cacheline_size > alignof(element) ? cacheline_size
+                                                     : alignof(element);
+
+  static element *newelements(allocator &alloc, size_t size) {
+    auto ptr = static_cast<element *>(
+        alloc.allocate(sizeof(element) * size, ringalign));
+    for (size_t i = 0; i < size; ++i)
+      new (ptr + i) element();
+    return ptr;
+  }
+
+  struct heapring { // Capacity == 0
+    heapring(size_t size, allocator const &a)
+        : alloc(a), modulo(size), elements(newelements(alloc, size)),
+          lines(spreadlines(size)) {}
+    ~heapring() {
+      for (size_t i = 0; i < modulo.qsize; ++i)
+        elements[i].~element();
+      alloc.deallocate(elements, sizeof(element) * modulo.qsize, ringalign);
+    }
+    inline size_t size() const { return modulo.qsize; }
+    inline seq_t index(seq_t const seq) const {
+      return spread(modulo.slot(seq), lines);
+    }
+    inline seq_t ticket(seq_t const seq) const { return modulo.ticket(seq); }
+    inline element &slotof(seq_t const seq) { return elements[index(seq)]; }
+    allocator alloc;
+    ringmodulo<seq_t> const modulo;
+    element *const elements; // pointer to buffer
+    seq_t const lines;       // used if spreading
+  };
+
+  // the divisions by the constant are turned into masks/shifts for powers of
+  // 2, and into multiplications by the reciprocal otherwise, no branch
+  struct inlinering { // Capacity > 0
+    inlinering(size_t, allocator const &) {}
+    inline size_t size() const { return Capacity; }
+    inline seq_t index(seq_t const seq) const {
+      return spread(seq % static_cast<seq_t>(Capacity), spreadlines(Capacity));
+    }
+    inline seq_t ticket(seq_t const seq) const {
+      return (seq / static_cast<seq_t>(Capacity)) << 1;
+    }
+    inline element &slotof(seq_t const seq) { return elements[index(seq)]; }
+    alignas(ringalign) element elements[Capacity > 0 ? Capacity : 1];
+  };
+
+  typename std::conditional<(Capacity > 0), inlinering, heapring>::type ring;
   alignas(cacheline_size) char cacheline_padding1[cacheline_size];
   alignas(cacheline_size) std::atomic<seq_t> enqueueIx;
+  std::atomic<seq_t> droppedcount; // TRAITS::Overwrite
   alignas(cacheline_size) char cacheline_padding2[cacheline_size];
   alignas(cacheline_size) std::atomic<seq_t> dequeueIx;
   alignas(cacheline_size) char cacheline_padding3[cacheline_size];
+  alignas(cacheline_size) eventcount notempty; // if TRAITS::Waitable
+  eventcount notfull;
+  std::atomic<bool> closedflag;
+  std::atomic<seq_t> sealpos; // enqueueIx when sealed, npos if not
+  alignas(cacheline_size) char cacheline_padding4[cacheline_size];
+};
+
+template <typename T, typename TRAITS = bounded_traits>
+class bounded_queue : public basic_bounded_queue<T, TRAITS> {
+public:
+  // (size, allocator const & = allocator())
+  using basic_bounded_queue<T, TRAITS>::basic_bounded_queue;
+};
+
+// bounded_queue of a compile time capacity, the ring is embedded in the
+// queue (no indirection), and indexing needs no division
+template <typename T, size_t Capacity, typename TRAITS = bounded_traits>
+class static_bounded_queue : public basic_bounded_queue<T, TRAITS, Capacity> {
+  static_assert(Capacity > 0, "use bounded_queue for a runtime capacity");
+
+public:
+  static_bounded_queue() {}
 };
 } // namespace async
@@ -0,0 +1,186 @@
+/////////////////////////////////////////////////////////////////////
+//          Copyright Yibo Zhu 2017
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+/////////////////////////////////////////////////////////////////////
+#pragma once
+#include "utility.h"
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#else
+#include <condition_variable>
+#include <mutex>
+#endif
+
+namespace async {
+// result of the waiting operations of the queues
+enum class wait_status : uint8_t {
+  ready,   // done
+  timeout, // gave up, the queue was still empty (full)
+  closed   // the queue is closed (and drained, for dequeues)
+};
+
+// lets threads sleep until a condition checked by lock-free code holds,
+// without a lock on the notifying side (an event count):
+//   auto key = ec.prepare_wait();
+//   if (condition) ec.cancel_wait(); else ec.wait(key);
+// the notifying side makes the condition true, then calls notify_*, which
+// costs a fence and a load when nobody waits. futex based on linux, mutex
+// and condition variable elsewhere. a shared one can be placed in memory
+// mapped by several processes (linux only)
+class eventcount {
+public:
+  using key_type = uint32_t;
+  explicit eventcount(bool shared = false)
+      : epoch(0), waiters(0), privateflag(shared ? 0 : privateop()) {}
+  eventcount(eventcount const &) = delete;
+  eventcount &operator=(eventcount const &) = delete;
+
+  inline key_type prepare_wait() noexcept {
+    waiters.fetch_add(1, std::memory_order_seq_cst);
+    return epoch.load(std::memory_order_seq_cst);
+  }
+
+  inline void cancel_wait() noexcept {
+    waiters.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  // sleep until notified after prepare_wait() returned the key
+  void wait(key_type key) noexcept {
+#if defined(__linux__)
+    while (epoch.load(std::memory_order_acquire) == key)
+      futex(FUTEX_WAIT, key, nullptr);
+#else
+    std::unique_lock<std::mutex> lk(mux);
+    while (epoch.load(std::memory_order_acquire) == key)
+      cv.wait(lk);
+#endif
+    waiters.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  // false if timed out
+  template <typename Clock, typename Duration>
+  bool wait_until(key_type key,
+                  std::chrono::time_point<Clock, Duration> const &deadline) {
+    bool notified(true);
+#if defined(__linux__)
+    while (epoch.load(std::memory_order_acquire) == key) {
+      auto left = deadline - Clock::now();
+      if (left <= Duration::zero()) {
+        notified = false;
+        break;
+      }
+      auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(left);
+      timespec ts;
+      ts.tv_sec = static_cast<time_t>(ns.count() / 1000000000);
+      ts.tv_nsec = static_cast<long>(ns.count() % 1000000000);
+      futex(FUTEX_WAIT, key, &ts);
+    }
+#else
+    std::unique_lock<std::mutex> lk(mux);
+    notified = cv.wait_until(lk, deadline, [&]() {
+      return epoch.load(std::memory_order_acquire) != key;
+    });
+#endif
+    waiters.fetch_sub(1, std::memory_order_relaxed);
+    return notified;
+  }
+
+  inline void notify_one() noexcept { notify(false); }
+  inline void notify_all() noexcept { notify(true); }
+
+  // spin, then sleep until attempt() returns true (ready), or isclosed()
+  // returns true (closed, after a last attempt)
+  template <typename Attempt, typename Closed>
+  wait_status await(Attempt &&attempt, Closed &&isclosed) {
+    return awaitimpl(attempt, isclosed,
+                     static_cast<std::chrono::steady_clock::time_point *>(
+                         nullptr));
+  }
+
+  // as await(), or timeout once the deadline has passed
+  template <typename Attempt, typename Closed, typename Clock,
+            typename Duration>
+  wait_status
+  await_until(Attempt &&attempt, Closed &&isclosed,
+              std::chrono::time_point<Clock, Duration> const &deadline) {
+    return awaitimpl(attempt, isclosed, &deadline);
+  }
+
+private:
+  static constexpr unsigned spinlimit = 128; // attempts before sleeping
+
+  template <typename Attempt, typename Closed, typename TimePoint>
+  wait_status awaitimpl(Attempt &attempt, Closed &isclosed,
+                        TimePoint const *deadline) {
+    for (unsigned i = 0; i < spinlimit; ++i) {
+      if (attempt())
+        return wait_status::ready;
+      if (isclosed())
+        return attempt() ? wait_status::ready : wait_status::closed;
+      cpu_relax();
+    }
+    for (;;) {
+      auto key = prepare_wait();
+      if (attempt()) {
+        cancel_wait();
+        return wait_status::ready;
+      }
+      if (isclosed()) {
+        cancel_wait();
+        return attempt() ? wait_status::ready : wait_status::closed;
+      }
+      if (deadline == nullptr)
+        wait(key);
+      else if (!wait_until(key, *deadline))
+        return attempt() ? wait_status::ready : wait_status::timeout;
+    }
+  }
+
+  inline void notify(bool all) noexcept {
+    // pairs with prepare_wait(), either the waiter sees the condition, or
+    // the notifier sees the waiter. it is paid on every notify: the queues
+    // publish with a release store, not a seq_cst RMW it could ride on
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters.load(std::memory_order_relaxed) == 0)
+      return;
+#if defined(__linux__)
+    epoch.fetch_add(1, std::memory_order_release);
+    futex(FUTEX_WAKE, all ? INT_MAX : 1, nullptr);
+#else
+    {
+      std::lock_guard<std::mutex> lg(mux); // no wakeup between check & wait
+      epoch.fetch_add(1, std::memory_order_release);
+    }
+    if (all)
+      cv.notify_all();
+    else
+      cv.notify_one();
+#endif
+  }
+
+#if defined(__linux__)
+  inline void futex(int op, key_type val, timespec const *timeout) noexcept {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&epoch), op | privateflag,
+            val, timeout, nullptr, 0);
+  }
+  static constexpr int privateop() { return FUTEX_PRIVATE_FLAG; }
+#else
+  static constexpr int privateop() { return 0; }
+  std::mutex mux;
+  std::condition_variable cv;
+#endif
+  std::atomic<key_type> epoch;
+  std::atomic<uint32_t> waiters;
+  int const privateflag; // futex op flag, 0 if shared by processes
+};
+} // namespace async
@@ -0,0 +1,167 @@
+/////////////////////////////////////////////////////////////////////
+//          Copyright Yibo Zhu 2017
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+/////////////////////////////////////////////////////////////////////
+#pragma once
+#include "utility.h"
+#include <atomic>
+#include <cassert>
+
+namespace async {
+// hazard pointers (Maged Michael's), a thread publishes the pointer it read
+// from a shared atomic before it uses the object, and a retired object is
+// freed only once no thread publishes it. each thread owns a record of
+// hazard::slots pointers (nested guards), from a process wide registry, the
+// records are reused by later threads, and never freed
+namespace hazard {
+static constexpr unsigned slots = 4; // max # of nested guards per thread
+
+struct record {
+  record() : active(true), next(nullptr), depth(0) {
+    for (auto &p : ptrs)
+      p.store(nullptr, std::memory_order_relaxed);
+  }
+  std::atomic<void const *> ptrs[slots];
+  std::atomic<bool> active; // owned by a thread
+  record *next;             // immutable once linked
+  unsigned depth;           // # of guards in use, owner only
+};
+
+class registry {
+public:
+  registry() : head(nullptr) {}
+  record *acquire() {
+    for (auto r = head.load(std::memory_order_acquire); r != nullptr;
+         r = r->next) {
+      bool inactive(false);
+      if (!r->active.load(std::memory_order_relaxed) &&
+          r->active.compare_exchange_strong(inactive, true,
+                                            std::memory_order_acquire))
+        return r;
+    }
+    auto r = new record;
+    auto first = head.load(std::memory_order_relaxed);
+    do {
+      r->next = first;
+    } while (!head.compare_exchange_weak(first, r, std::memory_order_release,
+                                         std::memory_order_relaxed));
+    return r;
+  }
+  void release(record *r) noexcept {
+    for (auto &p : r->ptrs)
+      p.store(nullptr, std::memory_order_release);
+    r->depth = 0;
+    r->active.store(false, std::memory_order_release);
+  }
+  // true if any thread publishes ptr
+  bool published(void const *ptr) const noexcept {
+    for (auto r = head.load(std::memory_order_acquire); r != nullptr;
+         r = r->next)
+      for (auto &p : r->ptrs)
+        if (p.load(std::memory_order_seq_cst) == ptr)
+          return true;
+    return false;
+  }
+
+private:
+  std::atomic<record *> head;
+};
+
+inline registry &getregistry() {
+  static registry *r = new registry; // used by static objects on exit
+  return *r;
+}
+
+inline record &myrecord() {
+  struct owner {
+    owner() : rec(getregistry().acquire()) {}
+    ~owner() { getregistry().release(rec); }
+    record *rec;
+  };
+  // a plain pointer, no initialization guard to check once it's set
+  static thread_local record *cached = nullptr;
+  if (cached == nullptr) {
+    static thread_local owner o;
+    cached = o.rec;
+  }
+  return *cached;
+}
+
+// a hazard slot of the calling thread, for the guard's lifetime
+template <typename P> class guard {
+public:
+  guard() : rec(myrecord()), slot(rec.depth++) {
+    assert(slot < slots); // too deeply nested
+  }
+  guard(guard const &) = delete;
+  guard &operator=(guard const &) = delete;
+  ~guard() {
+    rec.ptrs[slot].store(nullptr, std::memory_order_release);
+    --rec.depth;
+  }
+
+  // read src, and publish it, so it can't be freed until the guard is
+  // reset or destroyed
+  P *protect(std::atomic<P *> const &src) noexcept {
+    auto p = src.load(std::memory_order_relaxed);
+    for (;;) {
+      rec.ptrs[slot].store(p, std::memory_order_seq_cst);
+      auto q = src.load(std::memory_order_seq_cst);
+      if (q == p)
+        return p;
+      p = q;
+    }
+  }
+  void reset() noexcept {
+    rec.ptrs[slot].store(nullptr, std::memory_order_release);
+  }
+
+private:
+  record &rec;
+  unsigned const slot;
+};
+
+// a guard whose slot stays published after it's gone, so the next sticky
+// guard of the thread finding the same pointer in its slot skips the
+// publication (a seq_cst store), for pointers which rarely change. the
+// pointer is held until the thread publishes another one in the slot, or
+// exits
+template <typename P> class sticky_guard {
+public:
+  sticky_guard() : rec(myrecord()), slot(rec.depth++) {
+    assert(slot < slots); // too deeply nested
+  }
+  sticky_guard(sticky_guard const &) = delete;
+  sticky_guard &operator=(sticky_guard const &) = delete;
+  ~sticky_guard() { --rec.depth; }
+
+  P *protect(std::atomic<P *> const &src) noexcept {
+    auto p = src.load(std::memory_order_acquire);
+    if (rec.ptrs[slot].load(std::memory_order_relaxed) == p)
+      return p; // published since, it can't have been freed
+    for (;;) {
+      rec.ptrs[slot].store(p, std::memory_order_seq_cst);
+      auto q = src.load(std::memory_order_seq_cst);
+      if (q == p)
+        return p;
+      p = q;
+    }
+  }
+  void reset() noexcept {
+    rec.ptrs[slot].store(nullptr, std::memory_order_release);
+  }
+
+private:
+  record &rec;
+  unsigned const slot;
+};
+
+// true if ptr, retired (unreachable from the shared atomics), is still in
+// use, it can be freed otherwise
+inline bool published(void const *ptr) noexcept {
+  return getregistry().published(ptr);
+}
+} // namespace hazard
+} // namespace async
@@ -0,0 +1,316 @@
+/////////////////////////////////////////////////////////////////////
+//          Copyright Yibo Zhu 2017
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+/////////////////////////////////////////////////////////////////////
+#pragma once
+#include "allocator.h"
+#include "vmem.h"
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace async {
+// numa placement of the queues' storage, without libnuma. the pages are
+// placed by mbind (linux only, elsewhere they are left to first touch), and
+// the topology is read from sysfs. a simulated topology can be set, so the
+// placement logic can be tested on single node boxes, pages are not moved
+// then, their placement is recorded instead
+namespace numa {
+struct placement {
+  enum kind : uint8_t { LOCAL, BIND, PREFERRED, INTERLEAVE };
+  kind policy;
+  int node; // BIND and PREFERRED only
+  // the node of the allocating thread (what first touch would do)
+  static placement local() { return placement{LOCAL, -1}; }
+  // strictly on the node, no spill over, the node running out of memory is
+  // fatal (the pages can't be faulted in)
+  static placement bind(int node) { return placement{BIND, node}; }
+  // on the node while it has memory, spilling over to the others
+  static placement preferred(int node) { return placement{PREFERRED, node}; }
+  static placement interleave() { return placement{INTERLEAVE, -1}; }
+};
+
+namespace detail {
+struct topology {
+  size_t nodes = 1;
+  std::vector<int> cpunodes; // node of each cpu
+};
+
+struct simulation {
+  std::atomic<size_t> nodes{0}; // 0 if not simulated
+  std::mutex mux;
+  std::map<uintptr_t, std::pair<size_t, placement>> ranges;
+};
+
+inline simulation &getsimulation() {
+  static simulation *sim = new simulation; // used by static queues on exit
+  return *sim;
+}
+
+inline int &simulatednode() {
+  static thread_local int node = 0;
+  return node;
+}
+
+inline placement &currentplacement() {
+  static thread_local placement p = placement::local();
+  return p;
+}
+
+// parse a sysfs cpu/node list, e.g. "0-3,8-11"
+inline std::vector<size_t> parselist(std::string const &s) {
+  std::vector<size_t> ids;
+  size_t pos(0);
+  while (pos < s.size()) {
+    auto end = s.find(',', pos);
+    if (end == std::string::npos)
+      end = s.size();
+    auto item = s.substr(pos, end - pos);
+    auto dash = item.find('-');
+    try {
+      auto first = std::stoul(item.substr(0, dash));
+      auto last =
+          dash == std::string::npos ? first : std::stoul(item.substr(dash + 1));
+      for (auto id = first; id <= last; ++id)
+        ids.push_back(id);
+    } catch (...) { // malformed, skip it
+    }
+    pos = end + 1;
+  }
+  return ids;
+}
+
+inline std::string readline(std::string const &path) {
+  std::ifstream f(path);
+  std::string line;
+  std::getline(f, line);
+  return line;
+}
+
+inline topology const &gettopology() {
+  static topology const topo = []() {
+    topology t;
+#if defined(__linux__)
+    auto nodes = parselist(readline("/sys/devices/system/node/online"));
+    for (auto n : nodes) {
+      t.nodes = std::max(t.nodes, n + 1);
+      for (auto cpu : parselist(readline("/sys/devices/system/node/node" +
+                                         std::to_string(n) + "/cpulist"))) {
+        if (cpu >= t.cpunodes.size())
+          t.cpunodes.resize(cpu + 1, 0);
+        t.cpunodes[cpu] = static_cast<int>(n);
+      }
+    }
+#endif
+    return t;
+  }();
+  return topo;
+}
+
+#if defined(__linux__)
+enum : int { MPOL_PREFERRED_ = 1, MPOL_BIND_ = 2, MPOL_INTERLEAVE_ = 3 };
+enum : int { MPOL_F_NODE_ = 1, MPOL_F_ADDR_ = 2 };
+constexpr size_t maskbits = sizeof(unsigned long) * CHAR_BIT;
+#endif
+} // namespace detail
+
+// simulate a topology of the given # of nodes, cpu i belongs to node
+// i % nodes, and a thread can be moved by simulate_node(). 0 turns it off
+inline void simulate(size_t nodes) {
+  auto &sim = detail::getsimulation();
+  std::lock_guard<std::mutex> lg(sim.mux);
+  sim.nodes.store(nodes, std::memory_order_release);
+  sim.ranges.clear();
+}
+
+inline bool simulated() {
+  return detail::getsimulation().nodes.load(std::memory_order_acquire) > 0;
+}
+
+// the simulated node of the calling thread
+inline void simulate_node(int node) { detail::simulatednode() = node; }
+
+inline size_t node_count() {
+  auto nodes = detail::getsimulation().nodes.load(std::memory_order_acquire);
+  return nodes > 0 ? nodes : detail::gettopology().nodes;
+}
+
+inline int node_of_cpu(size_t cpu) {
+  auto nodes = detail::getsimulation().nodes.load(std::memory_order_acquire);
+  if (nodes > 0)
+    return static_cast<int>(cpu % nodes);
+  auto &cpunodes = detail::gettopology().cpunodes;
+  return cpu < cpunodes.size() ? cpunodes[cpu] : 0;
+}
+
+// node the calling thread is running on
+inline int current_node() {
+  if (simulated())
+    return detail::simulatednode();
+#if defined(__linux__)
+  auto cpu = sched_getcpu();
+  if (cpu >= 0)
+    return node_of_cpu(static_cast<size_t>(cpu));
+#endif
+  return 0;
+}
+
+// node of the first cpu the thread is allowed on, e.g. after
+// set_thread_affinity(), the current node if unknown
+inline int node_of(std::thread &t) {
+#if defined(__linux__)
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  if (pthread_getaffinity_np(t.native_handle(), sizeof(cpu_set_t), &cpuset) ==
+      0)
+    for (size_t cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+      if (CPU_ISSET(cpu, &cpuset))
+        return node_of_cpu(cpu);
+#else
+  (void)t;
+#endif
+  return current_node();
+}
+
+// apply the placement to pages not touched yet (page aligned range), false
+// if it can't be done here, the pages are left to first touch then
+inline bool place(void *ptr, size_t bytes, placement p) {
+  auto nodes = node_count();
+  if (p.policy == placement::LOCAL)
+    p = placement::bind(current_node());
+  if (p.policy != placement::INTERLEAVE &&
+      (p.node < 0 || static_cast<size_t>(p.node) >= nodes))
+    return false;
+  auto &sim = detail::getsimulation();
+  if (sim.nodes.load(std::memory_order_acquire) > 0) {
+    std::lock_guard<std::mutex> lg(sim.mux);
+    sim.ranges[reinterpret_cast<uintptr_t>(ptr)] = std::make_pair(bytes, p);
+    return true;
+  }
+#if defined(__linux__)
+  std::vector<unsigned long> mask((nodes + detail::maskbits - 1) /
+                                  detail::maskbits);
+  int mode(detail::MPOL_INTERLEAVE_);
+  if (p.policy != placement::INTERLEAVE) {
+    mode = p.policy == placement::BIND ? detail::MPOL_BIND_
+                                       : detail::MPOL_PREFERRED_;
+    mask[p.node / detail::maskbits] |= 1UL << (p.node % detail::maskbits);
+  } else {
+    for (size_t n = 0; n < nodes; ++n)
+      mask[n / detail::maskbits] |= 1UL << (n % detail::maskbits);
+  }
+  return syscall(SYS_mbind, ptr, vmem::round_up(bytes), mode, mask.data(),
+                 nodes + 1, 0) == 0;
+#else
+  (void)ptr;
+  return false;
+#endif
+}
+
+// drop the simulated placement of the range, no-op if not simulated
+inline void forget(void *ptr) {
+  auto &sim = detail::getsimulation();
+  if (sim.nodes.load(std::memory_order_acquire) == 0)
+    return;
+  std::lock_guard<std::mutex> lg(sim.mux);
+  sim.ranges.erase(reinterpret_cast<uintptr_t>(ptr));
+}
+
+// node holding the page at the address, -1 if unknown (not placed in a
+// simulation, or not faulted in yet)
+inline int node_of_address(void const *ptr) {
+  auto addr = reinterpret_cast<uintptr_t>(ptr);
+  auto &sim = detail::getsimulation();
+  if (sim.nodes.load(std::memory_order_acquire) > 0) {
+    std::lock_guard<std::mutex> lg(sim.mux);
+    auto it = sim.ranges.upper_bound(addr);
+    if (it == sim.ranges.begin())
+      return -1;
+    --it;
+    if (addr >= it->first + it->second.first)
+      return -1;
+    auto &p = it->second.second;
+    if (p.policy != placement::INTERLEAVE)
+      return p.node;
+    auto page = (addr - it->first) / vmem::page_size(); // round robin
+    return static_cast<int>(page % sim.nodes.load(std::memory_order_relaxed));
+  }
+#if defined(__linux__)
+  int node(-1);
+  if (syscall(SYS_get_mempolicy, &node, nullptr, 0, ptr,
+              detail::MPOL_F_NODE_ | detail::MPOL_F_ADDR_) == 0)
+    return node;
+#endif
+  return -1;
+}
+
+// placement of the numa_allocators constructed by the calling thread within
+// the scope, so of the queues built there, e.g. to build a bounded_queue
+// interleaved, on node 1, or on the node of its consumer thread:
+//   async::numa::scope s(async::numa::placement::bind(async::numa::node_of(t)));
+class scope {
+public:
+  explicit scope(placement p) : saved(detail::currentplacement()) {
+    detail::currentplacement() = p;
+  }
+  scope(scope const &) = delete;
+  scope &operator=(scope const &) = delete;
+  ~scope() { detail::currentplacement() = saved; }
+
+private:
+  placement const saved;
+};
+
+inline placement current_placement() { return detail::currentplacement(); }
+} // namespace numa
+
+// numa placed storage, blocks owning their pages are placed as the
+// allocator's placement says, the one of the numa::scope it's constructed
+// in, node-local by default. a queue keeps its allocator, so each of its
+// allocations follows the placement, whichever thread makes it, e.g. the
+// node groups allocated later by the producers, or by replenish(). with the
+// local placement they land on the node of the allocating thread. the
+// memory comes from Base (see allocator.h)
+template <typename Base = default_allocator> struct numa_allocator {
+  static constexpr bool hugepages = Base::hugepages;
+  numa_allocator() : where(numa::current_placement()) {}
+  explicit numa_allocator(numa::placement p) : where(p) {}
+  void *allocate(size_t bytes, size_t align) const {
+    auto ptr = Base::allocate(bytes, align);
+    if (ownpages(bytes))
+      numa::place(ptr, bytes, where);
+    return ptr;
+  }
+  void deallocate(void *ptr, size_t bytes, size_t align) const noexcept {
+    if (ownpages(bytes))
+      numa::forget(ptr);
+    Base::deallocate(ptr, bytes, align);
+  }
+  numa::placement placement() const { return where; }
+
+private:
+  // smaller blocks share their pages with others, they are left alone
+  static inline bool ownpages(size_t bytes) {
+    return bytes >= (Base::hugepages ? vmem::huge_page_size() / 2
+                                     : vmem::page_size());
+  }
+
+  numa::placement where;
+};
+} // namespace async
@@ -0,0 +1,257 @@
+/////////////////////////////////////////////////////////////////////
+//          Copyright Yibo Zhu 2017
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+/////////////////////////////////////////////////////////////////////
+#pragma once
+#include "queue.h"
+#include "spsc_queue.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace async {
+// thread-per-core runtime (shared-nothing), one worker pinned to each core,
+// each worker owns a local run queue, and receives tasks from the other
+// workers through a mesh of spsc rings (one ring per ordered pair of cores),
+// so nothing is shared between cores on the hot path. tasks submitted by
+// non-worker threads go through a per-core mpmc queue. a task must not block
+// on a task of its own core
+class percore_runtime final {
+public:
+  static constexpr size_t npos = static_cast<size_t>(-1);
+  static constexpr size_t cacheline_size = 64;
+
+  // cores: # of workers, worker i is pinned to the i-th cpu the calling
+  // thread is allowed on (modulo the # of them, see allowed_cpus()), one
+  // worker per allowed cpu by default. see cpu_of() for the pinning result
+  // ringsize: capacity of each spsc ring, tasks beyond it wait in the
+  // sender's overflow queue
+  explicit percore_runtime(size_t cores = allowed_cpus().size(),
+                           size_t ringsize = 128)
+      : corecount(cores > 0 ? cores : 1), stop(false) {
+    shards.reserve(corecount);
+    for (size_t i = 0; i < corecount; ++i)
+      shards.emplace_back(std::make_unique<shard>(corecount, i, ringsize));
+    auto cpus = allowed_cpus();
+    for (size_t i = 0; i < corecount; ++i) {
+      shards[i]->worker = std::thread([this, i]() { run(i); });
+      if (!cpus.empty() &&
+          set_thread_affinity(shards[i]->worker, cpus[i % cpus.size()]))
+        shards[i]->cpu = cpus[i % cpus.size()];
+    }
+  }
+
+  percore_runtime(percore_runtime const &) = delete;
+  percore_runtime(percore_runtime &&) = delete;
+  percore_runtime &operator=(percore_runtime const &) = delete;
+  percore_runtime &operator=(percore_runtime &&) = delete;
+
+  ~percore_runtime() {
+    stop.store(true, std::memory_order_release);
+    for (auto &s : shards) {
+      {
+        std::lock_guard<std::mutex> lg(s->mux);
+      }
+      s->cv.notify_one();
+    }
+    for (auto &s : shards)
+      s->worker.join();
+  }
+
+  size_t size() const { return corecount; }
+
+  // cpu the worker of core is pinned to, npos if it couldn't be pinned (not
+  // supported or not allowed), it runs wherever the os puts it then
+  size_t cpu_of(size_t core) const { return shards.at(core)->cpu; }
+
+  // core index of the calling worker, npos if not a worker of this runtime
+  size_t current_core() const {
+    auto &ctx = context();
+    if (ctx.runtime == this)
+      return ctx.core;
+    return npos;
+  }
+
+  // run the task on the given core, tasks submitted by the same worker to
+  // the same core run in submission order
+  template <typename Func, typename... Args>
+  inline auto submit_to(size_t core, Func &&func, Args &&... args)
+#if ((defined(__clang__) || defined(__GNUC__)) && __cplusplus <= 201103L) ||   \
+    (defined(_MSC_VER) && _MSC_VER <= 1800)
+      -> std::future<typename std::result_of<Func(Args...)>::type>
+#endif
+  {
+    if (core >= corecount)
+      throw std::out_of_range(ERROR_MSG("unknown core"));
+    auto taskptr = std::make_shared<
+        std::packaged_task<typename std::result_of<Func(Args...)>::type()>>(
+        std::bind(std::forward<Func>(func), std::forward<Args>(args)...));
+    dispatch(core, [taskptr]() { (*taskptr)(); });
+    return taskptr->get_future();
+  }
+
+private:
+  using task = std::function<void()>;
+  static constexpr unsigned spinlimit = 1024; // idle polls before sleeping
+  static constexpr unsigned batchsize = 64;   // tasks per ring per round
+
+  struct shard {
+    shard(size_t cores, size_t id, size_t ringsize)
+        : overflow(cores), incoming(cores), externalcount(0), sleeping(false),
+          cpu(npos) {
+      for (size_t from = 0; from < cores; ++from)
+        if (from != id)
+          incoming[from] = std::make_unique<spsc_queue<task>>(ringsize);
+    }
+    // owned by this core
+    std::deque<task> local;
+    std::vector<std::deque<task>> overflow; // to other cores, ring was full
+    // incoming[from] is filled by core "from" only
+    std::vector<std::unique_ptr<spsc_queue<task>>> incoming;
+    async::queue<task> external; // from non-worker threads
+    char cacheline_padding1[cacheline_size];
+    std::atomic<size_t> externalcount;
+    std::atomic<bool> sleeping;
+    std::mutex mux;
+    std::condition_variable cv;
+    std::thread worker;
+    size_t cpu; // pinned to, npos if not
+    char cacheline_padding2[cacheline_size];
+  };
+
+  struct workercontext {
+    percore_runtime const *runtime;
+    size_t core;
+  };
+
+  static workercontext &context() {
+    static thread_local workercontext ctx{nullptr, npos};
+    return ctx;
+  }
+
+  void dispatch(size_t core, task &&t) {
+    auto &ctx = context();
+    auto &dst = *shards[core];
+    if (ctx.runtime == this) {
+      auto &self = *shards[ctx.core];
+      if (ctx.core == core) { // the owner will see it, no wakeup needed
+        self.local.push_back(std::move(t));
+        return;
+      }
+      auto &pending = self.overflow[core];
+      if (!pending.empty() || !dst.incoming[ctx.core]->enqueue(std::move(t))) {
+        pending.push_back(std::move(t)); // keep the order, flushed by run()
+        return;
+      }
+    } else {
+      dst.external.enqueue(std::move(t));
+      dst.externalcount.fetch_add(1, std::memory_order_relaxed);
+    }
+    wake(dst);
+  }
+
+  // pairs with the fence in sleep(), either the sender sees the sleeping
+  // flag, or the sleeper sees the task
+  void wake(shard &dst) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (dst.sleeping.load(std::memory_order_relaxed)) {
+      std::lock_guard<std::mutex> lg(dst.mux);
+      dst.cv.notify_one();
+    }
+  }
+
+  bool hasinbound(shard &self) {
+    if (self.externalcount.load(std::memory_order_relaxed) > 0)
+      return true;
+    for (auto &ring : self.incoming)
+      if (ring && !ring->empty())
+        return true;
+    return false;
+  }
+
+  void sleep(shard &self) {
+    std::unique_lock<std::mutex> lk(self.mux);
+    self.sleeping.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (!stop.load(std::memory_order_acquire) && !hasinbound(self))
+      self.cv.wait(lk);
+    self.sleeping.store(false, std::memory_order_relaxed);
+  }
+
+  // move overflowed tasks into the rings, return true if any is left
+  bool flush(shard &self, size_t id) {
+    bool left(false);
+    for (size_t core = 0; core < corecount; ++core) {
+      auto &pending = self.overflow[core];
+      if (pending.empty())
+        continue;
+      auto &dst = *shards[core];
+      size_t moved(0);
+      for (; !pending.empty() &&
+             dst.incoming[id]->enqueue(std::move(pending.front()));
+           ++moved)
+        pending.pop_front();
+      if (moved > 0)
+        wake(dst);
+      left = left || !pending.empty();
+    }
+    return left;
+  }
+
+  void run(size_t id) {
+    context() = workercontext{this, id};
+    auto &self = *shards[id];
+    task t;
+    unsigned idle(0);
+    for (;;) {
+      size_t done(0);
+      // tasks queued by the running tasks wait for the next round
+      for (auto n = self.local.size(); n > 0; --n, ++done) {
+        t = std::move(self.local.front());
+        self.local.pop_front();
+        t();
+      }
+      for (auto &ring : self.incoming) {
+        for (unsigned n = 0; ring && n < batchsize && ring->dequeue(t);
+             ++n, ++done)
+          t();
+      }
+      for (unsigned n = 0; n < batchsize && self.external.dequeue(t);
+           ++n, ++done) {
+        self.externalcount.fetch_sub(1, std::memory_order_relaxed);
+        t();
+      }
+      t = nullptr;
+      auto pending = flush(self, id);
+      if (done > 0 || !self.local.empty()) {
+        idle = 0;
+        continue;
+      }
+      if (stop.load(std::memory_order_acquire))
+        return;
+      if (pending) { // receiver is busy, give it some time
+        std::this_thread::yield();
+      } else if (++idle < spinlimit) {
+        cpu_relax();
+      } else {
+        idle = 0;
+        sleep(self);
+      }
+    }
+  }
+
+  size_t const corecount;
+  std::vector<std::unique_ptr<shard>> shards;
+  alignas(cacheline_size) std::atomic<bool> stop;
+  alignas(cacheline_size) char cacheline_padding[cacheline_size];
+};
+} // namespace async
@@ -5,10 +5,22 @@
 //          http://www.boost.org/LICENSE_1_0.txt)
 /////////////////////////////////////////////////////////////////////
 #pragma once
+#include "allocator.h"
+#include "eventcount.h"
 #include "utility.h"
+#include "vmem.h"
+#include <algorithm>
 #include <array>
 #include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <exception>
 #include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 namespace async {
 struct traits // 3-level (L3, L2, L1) depth of nested group design, total
@@ -21,12 +33,41 @@ struct traits // 3-level (L3, L2, L1) depth of nested group design, total
   static constexpr uint64_t Basebits = 8;
   static constexpr bool NOEXCEPT_CHECK = false; // exception handling flag
   static constexpr size_t CachelineSize = 64;
+  // # of free nodes cached per thread (slot), 0 disables the magazines
+  static constexpr size_t MagazineSize = 16;
+  static constexpr size_t MagazineSlots = 64; // # of magazines per queue
+  // trim (see shrink_to_fit) when the free nodes exceed TrimRatio x the
+  // recent peak of nodes in use, checked on magazine flushes, 0 disables
+  static constexpr size_t TrimRatio = 0;
+  // reserve the address space of pow(2, FlatBits) nodes up front, and commit
+  // it on demand, so a node is found by one multiply-add instead of walking
+  // the nested groups, 0 disables. allocating more nodes fails as running out
+  // of memory does
+  static constexpr uint64_t FlatBits = 0;
+  // # of basecontainers kept allocated ahead of nodeCount by replenish(),
+  // which consumers call when they find the queue empty, or any idle (e.g.
+  // helper) thread, never the producers, 0 disables
+  static constexpr size_t AllocAhead = 0;
+  // align (and pad) each node to NodeAlign bytes, e.g. CachelineSize, so hot
+  // nodes don't share cache lines, 0 packs them as tight as T allows
+  static constexpr size_t NodeAlign = 0;
+  // store T on the heap (an allocation per enqueue), a node keeps a pointer
+  // only, for large T which is rarely in the queue
+  static constexpr bool OutOfLine = false;
+  // tag each index with a full 64-bit counter next to it, updated by a
+  // double-width CAS (needs ASYNC_HAS_DWCAS), so tags never wrap around, and
+  // Tagbits are left unused (lower them to enlarge the index space)
+  static constexpr bool WideIndex = false;
+  using allocator = default_allocator; // of the node groups, see allocator.h
+  // enqueues wake up the consumers sleeping in wait_dequeue*(), which need
+  // it, at the cost of a full fence per enqueue, paid even while nobody waits
+  static constexpr bool Waitable = false;
 };
 
 template <typename T, typename TRAITS = traits> class queue final {
 public:
   static bool is_lock_free_v() {
-    return std::atomic<uint64_t>{}.is_lock_free();
+    return TRAITS::WideIndex || std::atomic<uint64_t>{}.is_lock_free();
   }
   static constexpr size_t cacheline_size = TRAITS::CachelineSize;
   static constexpr uint64_t BaseMask = getBitmask<uint64_t>(TRAITS::Basebits);
@@ -38,8 +79,11 @@ public:
       getBitmask<uint64_t>(TRAITS::L3bits)
       << (TRAITS::Basebits + TRAITS::L1bits + TRAITS::L2bits);
   static constexpr uint64_t TagMask =
-      getBitmask<uint64_t>(TRAITS::Tagbits)
-      << (TRAITS::Basebits + TRAITS::L1bits + TRAITS::L2bits + TRAITS::L3bits);
+      TRAITS::WideIndex
+          ? 0
+          : getBitmask<uint64_t>(TRAITS::Tagbits)
+                << (TRAITS::Basebits + TRAITS::L1bits + TRAITS::L2bits +
+                    TRAITS::L3bits);
   static constexpr uint64_t TagShift = 64 - TRAITS::Tagbits;
   static constexpr uint64_t TagPlus1 = static_cast<uint64_t>(1) << TagShift;
 
@@ -54,23 +98,56 @@ public: // assert bits settings meet requirements
                 "All bits settings should be > 0 and Basebits must be > 3");
   static_assert(std::is_nothrow_destructible<T>::value,
                 "T must be nothrow destructible");
+  static_assert(TRAITS::MagazineSlots > 0, "MagazineSlots must be > 0");
+  static_assert(TRAITS::FlatBits <= 64 - TRAITS::Tagbits,
+                "FlatBits can't exceed the indexing space");
+  static_assert(!TRAITS::WideIndex || ASYNC_HAS_DWCAS,
+                "WideIndex needs a double-width CAS (build with -mcx16)");
+  static_assert((TRAITS::NodeAlign & (TRAITS::NodeAlign - 1)) == 0,
+                "NodeAlign must be 0 or a power of 2");
 
 public:
-  queue() : nodeCount(3), dequeueIx(2), enqueueIx(2), spawnIx(1), recycleIx(1) {
+  using allocator = typename TRAITS::allocator;
+
+  queue()
+      : alloc(), container(alloc),
+        magazines(TRAITS::MagazineSize > 0
+                      ? new std::atomic<magazine *>[TRAITS::MagazineSlots]()
+                      : nullptr),
+        nodeCount(3), dequeueIx(index(2, 1)), enqueueIx(index(2, 1)),
+        spawnIx(1), recycleIx(1), freenodes(0), peaknodes(0), trimmedcount(0),
+        aheadCount(0), replenishing(false), closedflag(false) {
     container.get(index(0)); // allocate initial space
+    container[index(2)].next.store(index(0, 1), std::memory_order_relaxed);
+    enlist();
   }
-  queue(size_t size) // pre-allocate size
-      : nodeCount(3), dequeueIx(2), enqueueIx(2), spawnIx(1), recycleIx(1) {
+  // pre-allocate size, all the storage is allocated through a
+  queue(size_t size, allocator const &a = allocator())
+      : alloc(a), container(alloc),
+        magazines(TRAITS::MagazineSize > 0
+                      ? new std::atomic<magazine *>[TRAITS::MagazineSlots]()
+                      : nullptr),
+        nodeCount(3), dequeueIx(index(2, 1)), enqueueIx(index(2, 1)),
+        spawnIx(1), recycleIx(1), freenodes(0), peaknodes(0), trimmedcount(0),
+        aheadCount(0), replenishing(false), closedflag(false) {
     container.get(index(0));
+    container[index(2)].next.store(index(0, 1), std::memory_order_relaxed);
 
-    if (size > (static_cast<uint64_t>(1) << TRAITS::Basebits)) {
-      index ix;
-      for (size_t i = (static_cast<uint64_t>(1) << TRAITS::Basebits); i < size;
-           ++i) {
-        auto &node = getNode(ix);
-        recycle(ix);
-      }
+    if (size > (static_cast<uint64_t>(1) << TRAITS::Basebits))
+      reserve(size - (static_cast<uint64_t>(1) << TRAITS::Basebits));
+    enlist();
+  }
+
+  ~queue() {
+    if (TRAITS::MagazineSize == 0)
+      return;
+    {
+      auto &r = getregistry();
+      std::lock_guard<std::mutex> lg(r.mux);
+      r.queues.erase(std::find(r.queues.begin(), r.queues.end(), this));
     }
+    for (size_t i = 0; i < TRAITS::MagazineSlots; ++i)
+      delete magazines[i].load(std::memory_order_relaxed);
   }
 
   queue(queue const &other) = delete;
@@ -84,11 +161,9 @@ public:
                 std::is_nothrow_constructible<T, Args &&...>::value>::type>
   inline void enqueue(Args &&... args) noexcept {
     auto ix = encapsulate(std::forward<Args>(args)...);
-    auto enqidx = enqueueIx.load(std::memory_order_relaxed);
-    while (!enqueueIx.compare_exchange_weak(
-        enqidx, ix, std::memory_order_release, std::memory_order_relaxed))
-      continue;
-    container[enqidx].next.store(ix, std::memory_order_release);
+    link(ix, ix);
+    if (TRAITS::Waitable)
+      notempty.notify_one();
   }
 
   template <typename... Args, // SAFE-IMPL
@@ -99,18 +174,19 @@ public:
     auto ix = encapsulate(std::forward<Args>(args)...);
     if (ix == 0)
       return false;
-    auto enqidx = enqueueIx.load(std::memory_order_relaxed);
-    while (!enqueueIx.compare_exchange_weak(
-        enqidx, ix, std::memory_order_release, std::memory_order_relaxed))
-      continue;
-    container[enqidx].next.store(ix, std::memory_order_release);
+    link(ix, ix);
+    if (TRAITS::Waitable)
+      notempty.notify_one();
     return true;
   }
 
   template <typename IT> void bulk_enqueue(IT it, size_t count) {
     index firstidx(0), preidx(0), lastidx(0);
     for (size_t i = 0; i < count; ++i) {
-      lastidx = encapsulate(*it++);
+      auto ix = encapsulate(*it++);
+      if (ix == 0)
+        continue; // failed, the chain goes on without it
+      lastidx = ix;
       if (firstidx == 0)
         firstidx = lastidx;
       if (preidx != 0) {
@@ -118,19 +194,71 @@ public:
       }
       preidx = lastidx;
     }
-    auto enqidx = enqueueIx.load(std::memory_order_relaxed);
-    while (!enqueueIx.compare_exchange_weak(
-        enqidx, lastidx, std::memory_order_release, std::memory_order_relaxed))
-      continue;
-    container[enqidx].next.store(firstidx, std::memory_order_release);
+    if (firstidx != 0) {
+      link(firstidx, lastidx);
+      if (TRAITS::Waitable)
+        notempty.notify_all();
+    }
   }
 
+  // claims a run of linked nodes with a single CAS on dequeueIx, and recycles
+  // them as one chain, the last node (next == 0) goes through dequeue()
   template <typename IT>
   size_t bulk_dequeue(IT &&it, size_t maxcount) // or IT& it to return the
   {
     size_t count(0);
-    while (maxcount-- && dequeue(*it++)) {
-      ++count;
+    backoff bo;
+    while (count < maxcount) {
+      auto deqidx = dequeueIx.load(std::memory_order_acquire);
+      auto enqidx = enqueueIx.load(std::memory_order_acquire);
+      index ix(deqidx), last(0);
+      auto next = container[ix].next.load(std::memory_order_acquire);
+      size_t claimed(0);
+      // stop at enqueueIx, the node it's on can't be recycled
+      for (; !isnull(next) && claimed < maxcount - count && !ix.is(enqidx);
+           next = container[ix].next.load(std::memory_order_acquire)) {
+        last = ix;
+        ix = next;
+        ++claimed;
+      }
+      if (claimed == 0) {
+        if (!isnull(next) && ix.is(enqidx)) { // lagging, help moving it
+          enqueueIx.compare_exchange_strong(enqidx, next,
+                                            std::memory_order_release,
+                                            std::memory_order_relaxed);
+          continue;
+        }
+        if (dequeue(*it)) { // only the tail is left
+          ++it;
+          ++count;
+        }
+        break;
+      }
+      if (!dequeueIx.compare_exchange_weak(deqidx, ix,
+                                           std::memory_order_acq_rel,
+                                           std::memory_order_relaxed)) {
+        bo.pause();
+        continue;
+      }
+      index cur(deqidx), first(deqidx);
+      auto recycled = claimed;
+      for (size_t i = 0; i < claimed; ++i) {
+        auto &node = container[cur];
+        next = node.next.load(std::memory_order_relaxed);
+        if (node.claim()) {
+          node.template move<TRAITS>(*it);
+          ++it;
+          ++count;
+        } else if (node.detach()) { // consumed in place by another thread,
+          first = next; // which recycles it, only the first node can be
+          --recycled;
+        }
+        cur = next;
+      }
+      if (recycled > 0) {
+        container[last].next.store(0, std::memory_order_relaxed);
+        recycle_chain(first, last, recycled); // still linked in order
+      }
     }
     return count;
   }
@@ -139,69 +267,256 @@ public:
                         // like insert_iterator
   inline bool dequeue(U &data) noexcept // return false if queue is empty
   {
+    backoff bo;
     for (;;) {
       auto deqidx = dequeueIx.load(std::memory_order_acquire);
       auto &node = container[deqidx];
-      auto next = node.next.load(std::memory_order_relaxed);
-      if (next == 0) {
-        auto ready_for_consume =
-            node.consume_ready.load(std::memory_order_relaxed);
-        if (!ready_for_consume) {
+      auto next = node.next.load(std::memory_order_acquire);
+      if (isnull(next)) {
+        if (!node.consume_ready()) {
+          if (TRAITS::AllocAhead > 0) // idle anyway
+            replenish();
           return false;
         }
 
-        if (node.consume_ready.compare_exchange_strong(
-                ready_for_consume, false, std::memory_order_release,
-                std::memory_order_relaxed)) {
-          node.template move<TRAITS>(data);
+        if (node.claim()) {
+          if (node.template move<TRAITS>(data)) // detached meanwhile by the
+            retire(deqidx);                     // thread which moved past it
           return true;
         }
       } else {
+        auto enqidx = enqueueIx.load(std::memory_order_acquire);
+        if (enqidx.is(deqidx)) { // lagging, help moving it first
+          enqueueIx.compare_exchange_strong(enqidx, next,
+                                            std::memory_order_release,
+                                            std::memory_order_relaxed);
+          continue;
+        }
         if (dequeueIx.compare_exchange_weak(deqidx, next,
                                             std::memory_order_acq_rel,
                                             std::memory_order_relaxed)) {
-          auto ready_for_consume =
-              node.consume_ready.load(std::memory_order_acquire);
-          if (ready_for_consume &&
-              node.consume_ready.compare_exchange_strong(
-                  ready_for_consume, false, std::memory_order_release,
-                  std::memory_order_relaxed)) {
+          auto ready_for_consume = node.claim();
+          if (ready_for_consume)
             node.template move<TRAITS>(data);
-          } else { // the node is being consumed by another thread, waiting for
-                   // it finishes
-            for (; !node.recycle_ready.load(std::memory_order_acquire);) {
-            }
-          }
-          node.next.store(
-              0, std::memory_order_relaxed); // reset link to avoid chain effect
-          recycle(deqidx);
+          // if it's being consumed in place by another thread, hand the
+          // recycling over to it instead of waiting
+          if (ready_for_consume || !node.detach())
+            retire(deqidx);
           if (ready_for_consume)
             return ready_for_consume;
+        } else {
+          bo.pause();
         }
       }
     }
   }
   uint64_t getNodeCount() { return nodeCount; } // get in-use-nodes count
 
-private:       // internal data structures
-  struct index // simulate tagged pointer
+  // block until an element is dequeued, spinning a while before sleeping.
+  // false if the queue is closed and drained (needs TRAITS::Waitable)
+  template <typename U> bool wait_dequeue(U &data) {
+    static_assert(TRAITS::Waitable, "wait_dequeue needs TRAITS::Waitable");
+    return notempty.await([&]() { return dequeue(data); },
+                          [this]() { return closed(); }) ==
+           wait_status::ready;
+  }
+
+  template <typename U, typename Rep, typename Period>
+  wait_status wait_dequeue_for(U &data,
+                               std::chrono::duration<Rep, Period> const &timeout) {
+    static_assert(TRAITS::Waitable, "wait_dequeue_for needs TRAITS::Waitable");
+    return notempty.await_until([&]() { return dequeue(data); },
+                                [this]() { return closed(); },
+                                std::chrono::steady_clock::now() + timeout);
+  }
+
+  // wake up all the waiting consumers, wait_dequeue*() report closed once
+  // the queue is drained. enqueue() is still allowed, it's up to the caller
+  void close() noexcept {
+    closedflag.store(true, std::memory_order_seq_cst);
+    notempty.notify_all();
+  }
+  bool closed() const noexcept {
+    return closedflag.load(std::memory_order_seq_cst);
+  }
+
+  // allocate (and touch) the basecontainers of the next TRAITS::AllocAhead
+  // groups past nodeCount, so producers don't pay for it when they cross a
+  // group boundary. returns the # of nodes made ready, 0 if they were ready
+  // or another thread is on it. cheap if they are, call it from any thread
+  // which is idle, e.g. a helper keeping ahead of a burst with no idle
+  // consumer
+  size_t replenish() noexcept {
+    auto target = (nodeCount.load(std::memory_order_relaxed) |
+                   BaseMask) + 1 + TRAITS::AllocAhead * groupsize;
+    auto ahead = aheadCount.load(std::memory_order_relaxed);
+    if (ahead >= target || replenishing.load(std::memory_order_relaxed) ||
+        replenishing.exchange(true, std::memory_order_acquire))
+      return 0;
+    ahead = std::max(aheadCount.load(std::memory_order_relaxed),
+                     nodeCount.load(std::memory_order_relaxed) & ~BaseMask);
+    size_t count(0);
+    try {
+      for (; ahead < target; ahead += groupsize, count += groupsize)
+        container.get(index(ahead));
+    } catch (...) { // out of memory, left to the producers
+    }
+    aheadCount.store(ahead, std::memory_order_relaxed);
+    replenishing.store(false, std::memory_order_release);
+    return count;
+  }
+
+  // allocate n more nodes into the free list, whole groups at a time, linked
+  // in advance and published with one CAS. the nodes are constructed, so
+  // their pages are touched (prefaulted) before reserve returns
+  void reserve(size_t n) {
+    if (n == 0)
+      return;
+    auto first = nodeCount.fetch_add(n, std::memory_order_relaxed);
+    auto last = first + n - 1;
+    for (auto g = first & ~BaseMask; g <= last; g += groupsize) {
+      auto begin = std::max(g, first);
+      auto end = std::min(g + groupsize - 1, last);
+      auto nodes = &container.at(index(begin)); // contiguous in the group
+      for (auto i = begin; i < end; ++i)
+        nodes[i - begin].next.store(index(i + 1), std::memory_order_relaxed);
+      nodes[end - begin].next.store(
+          end < last ? index(end + 1) : index(0), std::memory_order_relaxed);
+    }
+    recycle_chain(index(first), index(last), n);
+  }
+
+  // give the memory of fully free basecontainers back to the os, their
+  // address space is kept (stale readers stay safe), and reused before new
+  // nodes are allocated. returns the # of nodes' worth of memory released,
+  // which excludes groups the os couldn't take back. a basecontainer
+  // is released only in whole pages, so make it span whole pages (Basebits)
+  size_t shrink_to_fit() {
+    std::lock_guard<std::mutex> lg(trimmux);
+    return trim(0, true);
+  }
+
+private:             // internal data structures
+  struct narrowindex // simulate tagged pointer
   {
-    index(uint64_t newval) noexcept
+    narrowindex(uint64_t newval) noexcept
         : value(newval) {} // is_trivially_copyable must be true
-    index() noexcept : value(0) {}
+    narrowindex(uint64_t raw, uint64_t tag) noexcept
+        : value((raw & ~TagMask) | ((tag << TagShift) & TagMask)) {}
+    narrowindex() noexcept : value(0) {}
     inline operator uint64_t() const { return value; }
+    inline bool is(narrowindex const &other) const {
+      return value == other.value;
+    }
     std::uint64_t getVersion() { return (value & TagMask) >> TagShift; }
+    // tag 0 is skipped when the tag wraps around, the null link of a queued
+    // node would be the null link of the free list (0) otherwise
     inline void increTag() {
-      value = (value & ~TagMask) | ((value + TagPlus1) & TagMask);
+      auto tag = (value + TagPlus1) & TagMask;
+      value = (value & ~TagMask) | (tag == 0 ? TagPlus1 : tag);
     }
     std::uint64_t value;
   };
 
+  struct wideindex // index and its own 64-bit tag
+  {
+    wideindex(uint64_t newval) noexcept : value(newval), tag(0) {}
+    wideindex(uint64_t raw, uint64_t newtag) noexcept
+        : value(raw), tag(newtag) {}
+    wideindex() noexcept : value(0), tag(0) {}
+    inline operator uint64_t() const { return value; }
+    inline bool is(wideindex const &other) const {
+      return value == other.value && tag == other.tag;
+    }
+    std::uint64_t getVersion() { return tag; }
+    inline void increTag() {
+      if (++tag == 0)
+        tag = 1;
+    }
+    std::uint64_t value;
+    std::uint64_t tag;
+  };
+
+  using index = typename std::conditional<TRAITS::WideIndex, wideindex,
+                                          narrowindex>::type;
+
+#if ASYNC_HAS_DWCAS
+  // std::atomic<wideindex> isn't lock-free on every compiler, so the pair
+  // is read and written by dwcas only. the tags are per node, so a pair
+  // mixed from two loads could match a later incarnation of the node, the
+  // ABA the tag is there for. a load is a dwcas which writes back what it
+  // found (there is no plain 16 bytes atomic load on x86-64)
+  struct alignas(16) wideatomic {
+    wideatomic(index ix = index()) noexcept : value(ix.value), tag(ix.tag) {}
+    inline index load(std::memory_order = std::memory_order_seq_cst) const {
+      dwords cur{0, 0};
+      dwcas(const_cast<wideatomic *>(this), cur, cur);
+      return index(cur.lo, cur.hi);
+    }
+    inline void store(index ix,
+                      std::memory_order = std::memory_order_seq_cst) {
+      dwords cur{value.load(std::memory_order_relaxed),
+                 tag.load(std::memory_order_relaxed)};
+      while (!dwcas(this, cur, dwords{ix.value, ix.tag}))
+        ;
+    }
+    inline bool compare_exchange_strong(index &expected, index desired,
+                                        std::memory_order = {},
+                                        std::memory_order = {}) {
+      dwords exp{expected.value, expected.tag};
+      if (dwcas(this, exp, dwords{desired.value, desired.tag}))
+        return true;
+      expected = index(exp.lo, exp.hi);
+      return false;
+    }
+    inline bool compare_exchange_weak(index &expected, index desired,
+                                      std::memory_order = {},
+                                      std::memory_order = {}) {
+      return compare_exchange_strong(expected, desired);
+    }
+    std::atomic<uint64_t> value;
+    std::atomic<uint64_t> tag;
+  };
+#else
+  struct wideatomic;
+#endif
+
+  using atomic_index =
+      typename std::conditional<TRAITS::WideIndex, wideatomic,
+                                std::atomic<index>>::type;
+
+  // T is stored in the node, or on the heap if TRAITS::OutOfLine is true
+  struct inlinestorage {
+    template <typename... Args> inline void create(Args &&... args) {
+      new (&storage) T(std::forward<Args>(args)...);
+    }
+    inline void destroy() noexcept { get()->~T(); }
+    inline T *get() { return reinterpret_cast<T *>(&storage); }
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+  };
+
+  struct outoflinestorage {
+    template <typename... Args> inline void create(Args &&... args) {
+      ptr = new T(std::forward<Args>(args)...);
+    }
+    inline void destroy() noexcept { delete ptr; }
+    inline T *get() { return ptr; }
+    T *ptr;
+  };
+
+  static constexpr size_t nodealign =
+      TRAITS::NodeAlign > alignof(atomic_index) ? TRAITS::NodeAlign
+                                                 : alignof(atomic_index);
+
   struct node // to store the data
   {
-    node() : next(0), consume_ready(false), recycle_ready(true) {}
+    // FREE must be 0, trimmed nodes may read as zero. DETACHED: consuming,
+    // and dequeueIx has moved past it, the consumer recycles it
+    enum : uint8_t { FREE = 0, READY, CONSUMING, DETACHED };
+
+    node() : next(0), state(FREE) {}
     ~node() noexcept {
-      if (consume_ready.load(std::memory_order_relaxed)) {
+      if (consume_ready()) {
         destruct();
       }
     }
@@ -211,9 +526,8 @@ private:       // internal data structures
                   !TRAITS::NOEXCEPT_CHECK ||
                   std::is_nothrow_constructible<T, Args &&...>::value>::type>
     inline void construct(Args &&... args) noexcept {
-      new (&storage) T(std::forward<Args>(args)...);
-      consume_ready.store(true, std::memory_order_release);
-      recycle_ready.store(false, std::memory_order_release);
+      storage.create(std::forward<Args>(args)...);
+      state.store(READY, std::memory_order_release);
     }
 
     template <typename... Args, // SAFE-IMPL
@@ -222,27 +536,26 @@ private:       // internal data structures
                   !std::is_nothrow_constructible<T, Args &&...>::value>::type>
     inline bool construct(Args &&... args) noexcept {
       try {
-        new (&storage) T(std::forward<Args>(args)...);
+        storage.create(std::forward<Args>(args)...);
       } catch (...) {
         return false;
       }
 
-      consume_ready.store(true, std::memory_order_release);
-      recycle_ready.store(false, std::memory_order_release);
+      state.store(READY, std::memory_order_release);
       return true;
     }
 
-    inline void destruct() noexcept { reinterpret_cast<T *>(&storage)->~T(); }
+    inline void destruct() noexcept { storage.destroy(); }
 
     template <
         typename TR, typename U, // NON-SAFE
         typename std::enable_if<!TR::NOEXCEPT_CHECK ||
                                     std::is_nothrow_move_assignable<T>::value,
                                 int>::type = 0>
-    inline void move(U &data) {
+    inline bool move(U &data) { // true if detached meanwhile
       data = std::move(*getptr());
       destruct();
-      recycle_ready.store(true, std::memory_order_release);
+      return state.exchange(FREE, std::memory_order_acq_rel) == DETACHED;
     }
 
     template <
@@ -250,22 +563,47 @@ private:       // internal data structures
         typename std::enable_if<TR::NOEXCEPT_CHECK &&
                                     !std::is_nothrow_move_assignable<T>::value,
                                 int>::type = 0>
-    inline void move(U &data) {
+    inline bool move(U &data) { // true if detached meanwhile
       try {
         data = std::move(*getptr());
       } catch (...) {
       }
       destruct();
-      recycle_ready.store(true, std::memory_order_release);
+      return state.exchange(FREE, std::memory_order_acq_rel) == DETACHED;
+    }
+
+    inline bool consume_ready() {
+      return state.load(std::memory_order_relaxed) == READY;
     }
-    inline T *getptr() { return reinterpret_cast<T *>(&storage); }
-    std::atomic<index> next;         // link
-    std::atomic<bool> consume_ready; // if true, consume ready
-    std::atomic<bool> recycle_ready; // if true, recycle ready
-    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage; // data
+    inline bool claim() { // true if this thread is to consume it
+      auto expected = state.load(std::memory_order_acquire);
+      return expected == READY &&
+             state.compare_exchange_strong(expected, CONSUMING,
+                                           std::memory_order_acq_rel,
+                                           std::memory_order_relaxed);
+    }
+    inline bool detach() { // false if it's been consumed already
+      uint8_t expected = CONSUMING;
+      return state.compare_exchange_strong(expected, DETACHED,
+                                           std::memory_order_acq_rel,
+                                           std::memory_order_acquire);
+    }
+    inline void reset() { // back to a free node, after trimming
+      next.store(0, std::memory_order_relaxed);
+      state.store(FREE, std::memory_order_relaxed);
+    }
+    inline T *getptr() { return storage.get(); }
+    alignas(nodealign) atomic_index next; // link
+    std::atomic<uint8_t> state; // FREE -> READY -> CONSUMING (-> DETACHED)
+                                // -> FREE
+    typename std::conditional<TRAITS::OutOfLine, outoflinestorage,
+                              inlinestorage>::type storage; // data
   };
 
+  // default_allocator maps it page aligned if it spans pages, so it can be
+  // trimmed in whole pages
   struct basecontainer {
+    explicit basecontainer(allocator &) {}
     inline node &get(index const &ix) { return operator[](ix); }
     inline node &at(index const &ix) { return operator[](ix); }
     inline node &operator[](index const &ix) { return nodes[ix & BaseMask]; }
@@ -278,7 +616,8 @@ private:       // internal data structures
     static constexpr uint64_t shift = getShiftBitsCount(mask);
     std::array<std::atomic<SubGroup *>, static_cast<uint64_t>(1) << bits>
         subgroups;
-    nestedcontainer() {
+    allocator &alloc; // the queue's, each group is allocated through it
+    explicit nestedcontainer(allocator &a) : alloc(a) {
       for (auto &gptr : subgroups) {
         gptr.store(nullptr, std::memory_order_release);
       }
@@ -286,7 +625,7 @@ private:       // internal data structures
     ~nestedcontainer() {
       for (auto &gptr : subgroups) {
         if (gptr.load(std::memory_order_relaxed) != nullptr)
-          delete gptr.load(std::memory_order_relaxed);
+          destroy(gptr.load(std::memory_order_relaxed));
       }
     }
 
@@ -296,18 +635,31 @@ private:       // internal data structures
       auto ptr =
           subgroups[(ix & mask) >> shift].load(std::memory_order_acquire);
       if (ptr == nullptr) {
-        auto newgroup = std::make_unique<SubGroup>(); // if ComExch fails,
-                                                      // unique_ptr will self
-                                                      // delete
+        auto newgroup = create();
         if (subgroups[(ix & mask) >> shift].compare_exchange_strong(
-                ptr, newgroup.get(), std::memory_order_release,
-                std::memory_order_acquire)) {
-          ptr = newgroup.release();
-        }
+                ptr, newgroup, std::memory_order_release,
+                std::memory_order_acquire))
+          ptr = newgroup;
+        else
+          destroy(newgroup); // another thread was faster
       }
       return ptr->get(ix); // recursively calling get 'til get the node
     }
 
+    SubGroup *create() {
+      auto ptr = alloc.allocate(sizeof(SubGroup), alignof(SubGroup));
+      try {
+        return new (ptr) SubGroup(alloc);
+      } catch (...) {
+        alloc.deallocate(ptr, sizeof(SubGroup), alignof(SubGroup));
+        throw;
+      }
+    }
+    void destroy(SubGroup *group) noexcept {
+      group->~SubGroup();
+      alloc.deallocate(group, sizeof(SubGroup), alignof(SubGroup));
+    }
+
     inline node &operator[](index const &ix) {
       return subgroups[(ix & mask) >> shift]
           .load(std::memory_order_relaxed)
@@ -325,7 +677,69 @@ private:       // internal data structures
     }
   };
 
-  inline node &getNode(index &ix) { // return an existing or new node
+  // one contiguous reservation, committed a basecontainer's worth at a time
+  struct flatcontainer {
+    static constexpr uint64_t capacity = static_cast<uint64_t>(1)
+                                         << TRAITS::FlatBits;
+    explicit flatcontainer(allocator &)
+        : nodes(static_cast<node *>(vmem::reserve(capacity * sizeof(node)))),
+          committed(0), locked(false) {
+      if (nodes == nullptr)
+        throw std::bad_alloc();
+      if (allocator::hugepages)
+        vmem::advise_huge(nodes, capacity * sizeof(node));
+    }
+    ~flatcontainer() {
+      auto count = committed.load(std::memory_order_relaxed);
+      for (uint64_t i = 0; i < count; ++i)
+        nodes[i].~node();
+      vmem::release(nodes, capacity * sizeof(node));
+    }
+    inline node &get(index const &ix) { return at(ix); }
+    inline node &at(index const &ix) {
+      if ((ix & ~TagMask) >= committed.load(std::memory_order_acquire))
+        grow(ix & ~TagMask);
+      return nodes[ix & ~TagMask];
+    }
+    inline node &operator[](index const &ix) { return nodes[ix & ~TagMask]; }
+
+    void grow(uint64_t raw) {
+      while (locked.load(std::memory_order_relaxed) ||
+             locked.exchange(true, std::memory_order_acquire))
+        cpu_relax();
+      for (auto count = committed.load(std::memory_order_relaxed);
+           count <= raw;) {
+        auto last = capacity - count > groupsize // no std::min, it would
+                         ? count + groupsize     // odr-use capacity
+                         : capacity;
+        if (last == count) {
+          locked.store(false, std::memory_order_release);
+          throw std::bad_alloc(); // out of the reserved space
+        }
+        auto page = static_cast<uintptr_t>(vmem::page_size());
+        auto begin = reinterpret_cast<uintptr_t>(nodes + count) / page * page;
+        auto end = reinterpret_cast<uintptr_t>(nodes + last);
+        if (!vmem::commit(reinterpret_cast<void *>(begin),
+                          (end - begin + page - 1) / page * page)) {
+          locked.store(false, std::memory_order_release);
+          throw std::bad_alloc();
+        }
+        for (auto i = count; i < last; ++i)
+          new (nodes + i) node();
+        count = last;
+        committed.store(count, std::memory_order_release);
+      }
+      locked.store(false, std::memory_order_release);
+    }
+
+    node *const nodes;
+    std::atomic<uint64_t> committed; // # of nodes committed and constructed
+    std::atomic<bool> locked;
+  };
+
+  // an existing or new node, nullptr if out of memory (or out of the flat
+  // reservation)
+  inline node *getNode(index &ix) noexcept {
     #if defined(__arm__) && (!defined(__aarch64__))
     //for ARMV7 or below
     ix.value = nodeCount.load(std::memory_order_relaxed);
@@ -338,10 +752,49 @@ private:       // internal data structures
     ix.value = nodeCount.fetch_add(static_cast<std::uint64_t>(1),
                               std::memory_order_relaxed);
     #endif
-    if ((ix.value & BaseMask) == 0)
-      return container.get(ix);
-    else
-      return container.at(ix);
+    try {
+      if ((ix.value & BaseMask) == 0)
+        return &container.get(ix);
+      else
+        return &container.at(ix);
+    } catch (...) {
+      return nullptr;
+    }
+  }
+
+  // Michael-Scott style, the chain is linked to the tail node by a CAS
+  // first, then enqueueIx is moved by this thread, or by any other thread
+  // passing by, so a producer preempted in between doesn't hide the nodes
+  // behind it. the null link of a node carries its tag, so a stale tail
+  // can't be linked to
+  inline void link(index const &first, index const &last) {
+    backoff bo;
+    for (;;) {
+      auto enqidx = enqueueIx.load(std::memory_order_acquire);
+      auto &node = container[enqidx];
+      auto next = node.next.load(std::memory_order_acquire);
+      if (!isnull(next)) { // lagging, help moving it
+        enqueueIx.compare_exchange_weak(enqidx, next,
+                                        std::memory_order_release,
+                                        std::memory_order_relaxed);
+        continue;
+      }
+      index expected(0, enqidx.getVersion());
+      if (node.next.compare_exchange_weak(expected, first,
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed)) {
+        enqueueIx.compare_exchange_strong(enqidx, last,
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed);
+        return;
+      }
+      bo.pause();
+    }
+  }
+
+  inline void retire(index const &ix) { // dequeued node to the free list
+    container[ix].next.store(0, std::memory_order_relaxed);
+    recycle(ix);
   }
 
   template <typename... Args, // NON-SAFE
@@ -351,9 +804,11 @@ private:       // internal data structures
                 int>::type = 0>
   inline index encapsulate(Args &&... args) noexcept {
     auto ix = spawn();
+    if (ix == 0) // out of memory, enqueue can't report it
+      std::terminate();
     auto &node = container[ix];
     node.construct(std::forward<Args>(args)...);
-    node.next.store(0, std::memory_order_relaxed);
+    node.next.store(index(0, ix.getVersion()), std::memory_order_relaxed);
     return ix;
   }
 
@@ -364,8 +819,10 @@ private:       // internal data structures
                 int>::type = 0>
   inline index encapsulate(Args &&... args) noexcept {
     auto ix = spawn();
+    if (ix == 0)
+      return ix; // out of memory
     auto &node = container[ix];
-    node.next.store(0, std::memory_order_relaxed);
+    node.next.store(index(0, ix.getVersion()), std::memory_order_relaxed);
     if (node.construct(std::forward<Args>(args)...))
       return ix;
     else {
@@ -374,12 +831,159 @@ private:       // internal data structures
     }
   }
 
+  // per-thread cache of free nodes, so spawn/recycle don't touch the shared
+  // spawnIx/recycleIx in the common case, refilled/flushed in batches. the
+  // lock is only contended if threads share a slot. a slot's magazine is
+  // allocated by its first thread, so a queue pays for the slots in use
+  // only, and flushed when a thread of the slot exits
+  struct magazine {
+    magazine() : count(0) { locked.clear(); }
+    inline bool try_lock() {
+      return !locked.test_and_set(std::memory_order_acquire);
+    }
+    inline void unlock() { locked.clear(std::memory_order_release); }
+    std::atomic_flag locked;
+    size_t count;
+    std::array<index, TRAITS::MagazineSize> items;
+    char cacheline_padding[cacheline_size];
+  };
+
+  // the magazine of the calling thread, nullptr if out of memory
+  inline magazine *mymagazine() noexcept {
+    static thread_local size_t slot = TRAITS::MagazineSlots; // none yet
+    if (slot == TRAITS::MagazineSlots)
+      slot = threadslot();
+    auto m = magazines[slot].load(std::memory_order_acquire);
+    if (m != nullptr)
+      return m;
+    auto fresh = new (std::nothrow) magazine;
+    if (fresh != nullptr &&
+        !magazines[slot].compare_exchange_strong(m, fresh,
+                                                 std::memory_order_acq_rel,
+                                                 std::memory_order_acquire)) {
+      delete fresh; // another thread of the slot was faster
+      return m;
+    }
+    return fresh;
+  }
+
+  // the live queues of this type, an exiting thread flushes its magazine of
+  // each of them, so the nodes aren't kept from the other threads
+  struct registry {
+    std::mutex mux;
+    std::vector<queue *> queues;
+  };
+
+  static registry &getregistry() {
+    static registry *r = new registry; // used by threads exiting after main
+    return *r;
+  }
+
+  void enlist() {
+    if (TRAITS::MagazineSize == 0)
+      return;
+    auto &r = getregistry();
+    std::lock_guard<std::mutex> lg(r.mux);
+    r.queues.push_back(this);
+  }
+
+  static size_t threadslot() {
+    struct owner {
+      owner() {
+        static std::atomic<size_t> slots(0);
+        slot = slots.fetch_add(1, std::memory_order_relaxed) %
+               TRAITS::MagazineSlots;
+      }
+      ~owner() {
+        auto &r = getregistry();
+        std::lock_guard<std::mutex> lg(r.mux);
+        for (auto q : r.queues)
+          q->flushslot(slot);
+      }
+      size_t slot;
+    };
+    static thread_local owner o;
+    return o.slot;
+  }
+
+  void flushslot(size_t slot) noexcept {
+    auto m = magazines[slot].load(std::memory_order_acquire);
+    if (m == nullptr)
+      return;
+    while (!m->try_lock())
+      cpu_relax();
+    if (m->count > 0)
+      flush(*m, m->count);
+    m->unlock();
+  }
+
   inline void recycle(index const &ix) {
+    if (TRAITS::MagazineSize > 0) {
+      auto m = mymagazine();
+      if (m != nullptr && m->try_lock()) {
+        auto full = m->count == TRAITS::MagazineSize;
+        if (full) // flush the older half
+          flush(*m, TRAITS::MagazineSize / 2 + 1);
+        m->items[m->count++] = ix;
+        m->unlock();
+        if (TRAITS::TrimRatio > 0 && full)
+          trimpolicy();
+        return;
+      }
+    }
+    recycle_chain(ix, ix);
+  }
+
+  // move the first n nodes of the magazine to the free list as a chain
+  void flush(magazine &m, size_t n) {
+    for (size_t i = 0; i + 1 < n; ++i)
+      container[m.items[i]].next.store(m.items[i + 1],
+                                       std::memory_order_relaxed);
+    container[m.items[n - 1]].next.store(0, std::memory_order_relaxed);
+    recycle_chain(m.items[0], m.items[n - 1], n);
+    std::move(m.items.begin() + n, m.items.begin() + m.count, m.items.begin());
+    m.count -= n;
+  }
+
+  // append the chain first...last (last.next == 0) to the free list
+  inline void recycle_chain(index const &first, index const &last,
+                            size_t count = 1) {
+    if (TRAITS::TrimRatio > 0)
+      freenodes.fetch_add(static_cast<int64_t>(count),
+                          std::memory_order_relaxed);
     auto recycle = recycleIx.load(std::memory_order_relaxed);
     while (!recycleIx.compare_exchange_weak(
-        recycle, ix, std::memory_order_release, std::memory_order_relaxed))
+        recycle, last, std::memory_order_release, std::memory_order_relaxed))
       continue;
-    container[recycle].next.store(ix, std::memory_order_release);
+    container[recycle].next.store(first, std::memory_order_release);
+  }
+
+  // take up to TRAITS::MagazineSize / 2 nodes from the free list with one
+  // CAS, the last node of the free list always stays as its head
+  void refill(magazine &m) {
+    for (;;) {
+      auto spaidx = spawnIx.load(std::memory_order_acquire);
+      size_t n(0);
+      index ix(spaidx);
+      auto next = container[ix].next.load(std::memory_order_acquire);
+      for (; !isnull(next);) {
+        m.items[n++] = ix;
+        ix = next;
+        if (n == TRAITS::MagazineSize / 2 + 1)
+          break;
+        next = container[ix].next.load(std::memory_order_acquire);
+      }
+      if (n == 0)
+        return; // free list is empty
+      if (spawnIx.compare_exchange_weak(spaidx, ix, std::memory_order_acq_rel,
+                                        std::memory_order_relaxed)) {
+        m.count = n;
+        if (TRAITS::TrimRatio > 0)
+          freenodes.fetch_sub(static_cast<int64_t>(n),
+                              std::memory_order_relaxed);
+        return;
+      }
+    }
   }
 
   inline auto spawn()
@@ -388,17 +992,37 @@ private:       // internal data structures
       -> index
 #endif
   {
+    if (TRAITS::MagazineSize > 0) {
+      auto m = mymagazine();
+      if (m != nullptr && m->try_lock()) {
+        if (m->count == 0)
+          refill(*m);
+        if (m->count > 0) {
+          auto ix = m->items[--m->count];
+          m->unlock();
+          ix.increTag();
+          return ix;
+        }
+        m->unlock();
+      }
+    }
     index ix(0);
     for (;;) {
       auto spaidx = spawnIx.load(std::memory_order_acquire);
       auto next = container[spaidx].next.load(std::memory_order_relaxed);
-      if (next == 0) {
-        getNode(ix);
+      if (isnull(next)) {
+        if (trimmedcount.load(std::memory_order_relaxed) > 0 && revive())
+          continue;
+        if (getNode(ix) == nullptr)
+          return index(0);
+        ix.increTag(); // tag 0 is for the null links of the free list
         return ix;
       } else {
         if (spawnIx.compare_exchange_weak(spaidx, next,
                                           std::memory_order_acq_rel,
                                           std::memory_order_relaxed)) {
+          if (TRAITS::TrimRatio > 0)
+            freenodes.fetch_sub(1, std::memory_order_relaxed);
           if (spaidx != 0) {
             spaidx.increTag();
           }
@@ -407,21 +1031,199 @@ private:       // internal data structures
       }
     }
   }
- 
+
+  static constexpr uint64_t groupsize = static_cast<uint64_t>(1)
+                                        << TRAITS::Basebits;
+  static inline uint64_t rawindex(index const &ix) { return ix & ~TagMask; }
+  static inline bool isnull(index const &ix) { return rawindex(ix) == 0; }
+
+  // take up to max nodes from the head of the free list (the ones free for
+  // the longest), the last one always stays. with all, take the whole free
+  // list, and the nodes cached in the magazines which are not in use
+  void claimfree(std::vector<index> &nodes, size_t max, bool all) {
+    for (;;) {
+      nodes.clear();
+      auto spaidx = spawnIx.load(std::memory_order_acquire);
+      index ix(spaidx);
+      for (auto next = container[ix].next.load(std::memory_order_acquire);
+           !isnull(next) && (all || nodes.size() < max);
+           next = container[ix].next.load(std::memory_order_acquire)) {
+        nodes.push_back(ix);
+        ix = next;
+      }
+      if (nodes.empty() ||
+          spawnIx.compare_exchange_strong(spaidx, ix, std::memory_order_acq_rel,
+                                          std::memory_order_relaxed))
+        break;
+    }
+    if (TRAITS::TrimRatio > 0)
+      freenodes.fetch_sub(static_cast<int64_t>(nodes.size()),
+                          std::memory_order_relaxed);
+    for (size_t i = 0;
+         all && TRAITS::MagazineSize > 0 && i < TRAITS::MagazineSlots; ++i) {
+      auto m = magazines[i].load(std::memory_order_acquire);
+      if (m == nullptr || !m->try_lock())
+        continue;
+      nodes.insert(nodes.end(), m->items.begin(), m->items.begin() + m->count);
+      m->count = 0;
+      m->unlock();
+    }
+  }
+
+  // release the fully free basecontainers among the free nodes, all of them,
+  // or the ones in the surplus above keep free nodes, so the producers still
+  // find free nodes meanwhile, and don't grow. returns the # of nodes'
+  // worth of memory which went back to the os
+  size_t trim(size_t keep, bool all) { // trimmux must be held
+    std::vector<index> nodes;
+    if (!all) {
+      auto free = freenodes.load(std::memory_order_relaxed);
+      if (free <= static_cast<int64_t>(keep))
+        return 0;
+      claimfree(nodes, static_cast<size_t>(free) - keep, false);
+    } else {
+      claimfree(nodes, 0, true);
+    }
+    auto groups =
+        (nodeCount.load(std::memory_order_acquire) >> TRAITS::Basebits) + 1;
+    std::vector<uint64_t> counts(groups, 0), tags(groups, 0);
+    for (auto &ix : nodes) {
+      auto g = rawindex(ix) >> TRAITS::Basebits;
+      ++counts[g];
+      tags[g] = std::max(tags[g], ix.getVersion());
+    }
+    // only the whole pages inside a basecontainer can go, huge pages if the
+    // allocator maps them
+    auto page = static_cast<uintptr_t>(allocator::hugepages
+                                           ? vmem::huge_page_size()
+                                           : vmem::page_size());
+    for (uint64_t g = 0; g < groups; ++g) {
+      if (counts[g] == groupsize && pagesof(g, page).second == 0)
+        counts[g] = 0; // too small to trim, keep it in the free list
+    }
+    index first(0), last(0); // give the rest back first, as one chain
+    size_t count(0);
+    for (auto ix : nodes) {
+      if (counts[rawindex(ix) >> TRAITS::Basebits] == groupsize)
+        continue;
+      ix.increTag(); // stale CASes on spawnIx must fail
+      if (last != 0)
+        container[last].next.store(ix, std::memory_order_relaxed);
+      else
+        first = ix;
+      last = ix;
+      ++count;
+    }
+    if (count > 0) {
+      container[last].next.store(0, std::memory_order_relaxed);
+      recycle_chain(first, last, count);
+    }
+    size_t released(0);
+    for (uint64_t g = 0; g < groups; ++g) {
+      if (counts[g] != groupsize)
+        continue;
+      // revived with a newer tag, so stale CASes on spawnIx fail
+      index revived(g << TRAITS::Basebits, tags[g]);
+      revived.increTag();
+      auto pages = pagesof(g, page);
+      if (!vmem::discard(pages.first, pages.second)) {
+        relink(revived); // kept, e.g. huge pages can't be split
+        continue;
+      }
+      trimmed.push_back(revived);
+      released += pages.second / sizeof(node); // the edges stay
+    }
+    trimmedcount.store(trimmed.size(), std::memory_order_release);
+    return released;
+  }
+
+  // the whole pages inside basecontainer g, {ptr, 0} if there is none
+  std::pair<void *, size_t> pagesof(uint64_t g, uintptr_t page) {
+    auto begin =
+        reinterpret_cast<uintptr_t>(&container[index(g << TRAITS::Basebits)]);
+    auto end = begin + groupsize * sizeof(node);
+    begin = (begin + page - 1) / page * page;
+    end = end / page * page;
+    return {reinterpret_cast<void *>(begin), end > begin ? end - begin : 0};
+  }
+
+  // put a trimmed basecontainer back into the free list, false if there is
+  // none or a trim is going on
+  bool revive() {
+    std::unique_lock<std::mutex> lk(trimmux, std::try_to_lock);
+    if (!lk.owns_lock() || trimmed.empty())
+      return false;
+    auto first = trimmed.back();
+    trimmed.pop_back();
+    trimmedcount.store(trimmed.size(), std::memory_order_release);
+    relink(first);
+    return true;
+  }
+
+  // link the nodes of the basecontainer starting at first, whose content
+  // may have been discarded, and append them to the free list
+  void relink(index first) {
+    index last(first);
+    for (uint64_t i = 0; i < groupsize; ++i) {
+      auto &node = container[last];
+      index next(i + 1 < groupsize ? last + 1 : 0, first.getVersion());
+      node.reset();
+      node.next.store(i + 1 < groupsize ? next : index(0),
+                      std::memory_order_relaxed);
+      if (i + 1 < groupsize)
+        last = next;
+    }
+    recycle_chain(first, last, groupsize);
+  }
+
+  // trim if the free nodes exceed TrimRatio x the peak of nodes in use, down
+  // to the peak, the peak decays by 1/16 on each check, so it follows the
+  // recent demand
+  void trimpolicy() {
+    auto free = freenodes.load(std::memory_order_relaxed);
+    auto total = static_cast<int64_t>(
+        nodeCount.load(std::memory_order_relaxed) -
+        trimmedcount.load(std::memory_order_relaxed) * groupsize);
+    auto inuse = std::max<int64_t>(total - free, 0);
+    auto peak = peaknodes.load(std::memory_order_relaxed);
+    peak = std::max<int64_t>(inuse, peak - peak / 16);
+    peaknodes.store(peak, std::memory_order_relaxed);
+    if (free < static_cast<int64_t>(2 * groupsize) ||
+        free <= static_cast<int64_t>(TRAITS::TrimRatio) * peak)
+      return;
+    std::unique_lock<std::mutex> lk(trimmux, std::try_to_lock);
+    if (lk.owns_lock())
+      trim(static_cast<size_t>(peak), false); // a peak's worth stays free
+  }
+
   using L1container = nestedcontainer<basecontainer, L1Mask>;
   using L2container = nestedcontainer<L1container, L2Mask>;
-  nestedcontainer<L2container, L3Mask> container;
+  allocator alloc;
+  typename std::conditional<(TRAITS::FlatBits > 0), flatcontainer,
+                            nestedcontainer<L2container, L3Mask>>::type
+      container;
+  std::unique_ptr<std::atomic<magazine *>[]> const magazines; // by slot
   alignas(cacheline_size) char cacheline_padding1[cacheline_size];
   alignas(cacheline_size) std::atomic<uint64_t> nodeCount; // # of allocated nodes, not the #
                                                            // of elements stored in the queue
   alignas(cacheline_size) char cacheline_padding2[cacheline_size];
-  alignas(cacheline_size) std::atomic<index> dequeueIx;    // dequeue pointer
+  alignas(cacheline_size) atomic_index dequeueIx;    // dequeue pointer
   alignas(cacheline_size) char cacheline_padding3[cacheline_size];
-  alignas(cacheline_size) std::atomic<index> enqueueIx;    // enqueue pointer
+  alignas(cacheline_size) atomic_index enqueueIx;    // enqueue pointer
   alignas(cacheline_size) char cacheline_padding4[cacheline_size];
-  alignas(cacheline_size) std::atomic<index> spawnIx;      // spawn pointer
+  alignas(cacheline_size) atomic_index spawnIx;      // spawn pointer
   alignas(cacheline_size) char cacheline_padding5[cacheline_size];
-  alignas(cacheline_size) std::atomic<index> recycleIx;    // recycle pointer
+  alignas(cacheline_size) atomic_index recycleIx;    // recycle pointer
   alignas(cacheline_size) char cacheline_padding6[cacheline_size];
+  alignas(cacheline_size) std::atomic<int64_t> freenodes;  // if TrimRatio > 0
+  std::atomic<int64_t> peaknodes;    // recent peak of nodes in use
+  std::atomic<size_t> trimmedcount;  // # of trimmed basecontainers
+  std::mutex trimmux;                // guards trimmed
+  std::vector<index> trimmed;        // first node of each, with its next tag
+  alignas(cacheline_size) std::atomic<uint64_t> aheadCount; // allocated below
+  std::atomic<bool> replenishing;
+  alignas(cacheline_size) eventcount notempty; // if TRAITS::Waitable
+  std::atomic<bool> closedflag;
+  alignas(cacheline_size) char cacheline_padding7[cacheline_size];
 };
 } // namespace async
\ No newline at end of file
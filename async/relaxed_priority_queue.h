@@ -0,0 +1,163 @@
+/////////////////////////////////////////////////////////////////////
+//          Copyright Yibo Zhu 2017
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+/////////////////////////////////////////////////////////////////////
+#pragma once
+#include "utility.h"
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace async {
+struct relaxed_pq_traits {
+  static constexpr size_t CachelineSize = 64;
+  static constexpr unsigned PopAttempts = 8; // random probes before a full scan
+};
+
+// relaxed concurrent min-priority queue (MultiQueue design), entries are
+// spread over many small heaps, each guarded by its own try-lock, push goes to
+// a random heap, pop compares the cached tops of two random heaps and takes
+// the smaller one. the order is approximate, not strict, in exchange there is
+// no global lock or global heap. smaller key = higher priority, key must be
+// an integral type, any value of it is a valid key
+template <typename K, typename V, typename TRAITS = relaxed_pq_traits>
+class relaxed_priority_queue final {
+  static_assert(std::is_integral<K>::value, "K must be an integral type");
+
+public:
+  static constexpr size_t cacheline_size = TRAITS::CachelineSize;
+  // the top of an empty heap, so it loses the comparisons in try_pop, a
+  // heap holding keys of max() is told apart by its empty flag
+  static constexpr K emptykey = std::numeric_limits<K>::max();
+
+  // heaps: # of internal heaps, 2x of the # of concurrent users is a good
+  // choice, 1 turns it into a strict (but locked) priority queue
+  explicit relaxed_priority_queue(size_t heaps)
+      : heapcount(heaps > 0 ? heaps : 1),
+        subqueues(new subqueue[heapcount]), count(0) {}
+
+  relaxed_priority_queue(relaxed_priority_queue const &) = delete;
+  relaxed_priority_queue(relaxed_priority_queue &&) = delete;
+  relaxed_priority_queue &operator=(relaxed_priority_queue const &) = delete;
+  relaxed_priority_queue &operator=(relaxed_priority_queue &&) = delete;
+
+  template <typename... Args> void push(K key, Args &&... args) {
+    for (;;) {
+      auto &q = subqueues[random() % heapcount];
+      if (!q.try_lock())
+        continue;
+      try {
+        q.heap.emplace_back(key, std::forward<Args>(args)...);
+        std::push_heap(q.heap.begin(), q.heap.end(), later);
+      } catch (...) { // V's constructor threw, or out of memory
+        q.unlock();
+        throw;
+      }
+      q.top.store(q.heap.front().key, std::memory_order_relaxed);
+      q.empty.store(false, std::memory_order_relaxed);
+      q.unlock();
+      count.fetch_add(1, std::memory_order_release);
+      return;
+    }
+  }
+
+  // return false if queue is empty, the popped entry is one of the smallest,
+  // but not necessarily the smallest one
+  bool try_pop(K &key, V &value) {
+    for (unsigned i = 0; i < TRAITS::PopAttempts; ++i) {
+      if (count.load(std::memory_order_acquire) <= 0)
+        return false;
+      auto &a = subqueues[random() % heapcount];
+      auto &b = subqueues[random() % heapcount];
+      auto &q = b.top.load(std::memory_order_relaxed) <
+                        a.top.load(std::memory_order_relaxed)
+                    ? b
+                    : a;
+      if (!q.empty.load(std::memory_order_relaxed) && pop(q, key, value))
+        return true;
+    }
+    // unlucky probes, scan all heaps before reporting empty
+    for (size_t i = 0; i < heapcount; ++i) {
+      if (!subqueues[i].empty.load(std::memory_order_relaxed) &&
+          pop(subqueues[i], key, value))
+        return true;
+    }
+    return false;
+  }
+
+  // approximate # of entries
+  size_t size() const {
+    auto c = count.load(std::memory_order_relaxed);
+    return c > 0 ? static_cast<size_t>(c) : 0;
+  }
+  bool empty() const { return size() == 0; }
+
+private:
+  struct entry {
+    template <typename... Args>
+    entry(K k, Args &&... args) : key(k), value(std::forward<Args>(args)...) {}
+    K key;
+    V value;
+  };
+
+  static bool later(entry const &l, entry const &r) { return l.key > r.key; }
+
+  struct subqueue {
+    subqueue() : locked(false), top(emptykey), empty(true) {}
+    inline bool try_lock() {
+      return !locked.load(std::memory_order_relaxed) &&
+             !locked.exchange(true, std::memory_order_acquire);
+    }
+    inline void unlock() { locked.store(false, std::memory_order_release); }
+    std::atomic<bool> locked;
+    std::atomic<K> top; // cached key of heap.front(), read without the lock
+    std::atomic<bool> empty; // cached heap.empty(), read without the lock
+    std::vector<entry> heap;
+    char cacheline_padding[cacheline_size];
+  };
+
+  bool pop(subqueue &q, K &key, V &value) {
+    if (!q.try_lock())
+      return false;
+    if (q.heap.empty()) {
+      q.unlock();
+      return false;
+    }
+    std::pop_heap(q.heap.begin(), q.heap.end(), later);
+    key = q.heap.back().key;
+    value = std::move(q.heap.back().value);
+    q.heap.pop_back();
+    if (q.heap.empty()) {
+      q.top.store(emptykey, std::memory_order_relaxed);
+      q.empty.store(true, std::memory_order_relaxed);
+    } else
+      q.top.store(q.heap.front().key, std::memory_order_relaxed);
+    q.unlock();
+    count.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  static inline uint64_t random() { // xorshift64*, one state per thread
+    static thread_local uint64_t state =
+        0x9E3779B97F4A7C15ULL ^
+        static_cast<uint64_t>(
+            std::hash<std::thread::id>()(std::this_thread::get_id()));
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545F4914F6CDD1DULL;
+  }
+
+  size_t const heapcount;
+  std::unique_ptr<subqueue[]> const subqueues;
+  alignas(cacheline_size) char cacheline_padding1[cacheline_size];
+  alignas(cacheline_size) std::atomic<int64_t> count; // # of entries
+  alignas(cacheline_size) char cacheline_padding2[cacheline_size];
+};
+} // namespace async
@@ -0,0 +1,147 @@
+/////////////////////////////////////////////////////////////////////
+//          Copyright Yibo Zhu 2017
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+/////////////////////////////////////////////////////////////////////
+#pragma once
+#include "bounded_queue.h"
+#include "hazard.h"
+#include <atomic>
+#include <cassert>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace async {
+// bounded_queue whose capacity can be changed while it's in use. resize()
+// links a ring of the new capacity after the current one, moves the
+// producers to it, and seals the old ring, so it takes no more elements.
+// the consumers drain the old ring first, then follow the link, and the
+// drained ring is freed once no thread refers to it (hazard pointers), so
+// the elements keep their order, and nothing is copied. an operation works
+// on one ring like bounded_queue does. the hazard pointer of a thread stays
+// published between its operations, and is published again only once a
+// resize moved the ring, so a drained ring can be held by a thread until
+// its next operation, or exit
+template <typename T, typename TRAITS = bounded_traits>
+class resizable_bounded_queue {
+  static_assert(!TRAITS::Overwrite, "a sealed ring can't be overwritten");
+
+public:
+  using allocator = typename TRAITS::allocator;
+  // the rings are allocated through a copy of the allocator a
+  explicit resizable_bounded_queue(size_t size,
+                                   allocator const &a = allocator())
+      : alloc(a), head(newring(size)), tail(head.load(std::memory_order_relaxed)),
+        capacity(size) {}
+  resizable_bounded_queue(resizable_bounded_queue const &) = delete;
+  resizable_bounded_queue(resizable_bounded_queue &&) = delete;
+  resizable_bounded_queue &operator=(resizable_bounded_queue const &) = delete;
+  resizable_bounded_queue &operator=(resizable_bounded_queue &&) = delete;
+  ~resizable_bounded_queue() {
+    for (auto r = head.load(std::memory_order_relaxed); r != nullptr;) {
+      auto next = r->next.load(std::memory_order_relaxed);
+      deletering(r);
+      r = next;
+    }
+    for (auto r : retired)
+      deletering(r);
+  }
+
+  // capacity of the ring the producers are on, the elements of the rings
+  // being drained come on top of it
+  size_t size() const { return capacity.load(std::memory_order_relaxed); }
+
+  template <typename... Args> bool enqueue(Args &&... args) {
+    hazard::sticky_guard<ring> g;
+    for (;;) {
+      auto r = g.protect(tail);
+      if (r->q.enqueue(std::forward<Args>(args)...))
+        return true;
+      if (r->next.load(std::memory_order_acquire) == nullptr)
+        return false; // queue is full
+      // sealed by a resize, tail has moved on
+    }
+  }
+
+  template <typename U> bool dequeue(U &data) {
+    hazard::sticky_guard<ring> g;
+    for (;;) {
+      auto r = g.protect(head);
+      if (r->q.dequeue(data))
+        return true;
+      auto next = r->next.load(std::memory_order_acquire);
+      if (next == nullptr || !r->q.drained())
+        return false; // queue is empty
+      if (head.compare_exchange_strong(r, next, std::memory_order_acq_rel,
+                                       std::memory_order_relaxed)) {
+        g.reset();
+        retire(r);
+      }
+    }
+  }
+
+  // move the producers to a new ring of the given capacity, the elements
+  // in the queue stay where they are, until they are dequeued. can be called
+  // by any thread, concurrently with the others, to grow the queue under
+  // pressure, or to shrink it once idle
+  void resize(size_t size) {
+    auto r = newring(size);
+    std::lock_guard<std::mutex> lg(resizemux);
+    auto last = tail.load(std::memory_order_relaxed);
+    last->next.store(r, std::memory_order_release); // before the seal, so a
+    tail.store(r, std::memory_order_release);       // sealed ring has a next
+    capacity.store(size, std::memory_order_relaxed);
+    last->q.seal();
+    reclaim();
+  }
+
+private:
+  struct ring {
+    ring(size_t size, allocator const &a) : q(size, a), next(nullptr) {}
+    basic_bounded_queue<T, TRAITS> q;
+    std::atomic<ring *> next;
+  };
+
+  ring *newring(size_t size) {
+    auto ptr = alloc.allocate(sizeof(ring), alignof(ring));
+    try {
+      return new (ptr) ring(size, alloc);
+    } catch (...) {
+      alloc.deallocate(ptr, sizeof(ring), alignof(ring));
+      throw;
+    }
+  }
+
+  void deletering(ring *r) noexcept {
+    r->~ring();
+    alloc.deallocate(r, sizeof(ring), alignof(ring));
+  }
+
+  void retire(ring *r) {
+    std::lock_guard<std::mutex> lg(resizemux);
+    retired.push_back(r);
+    reclaim();
+  }
+
+  void reclaim() { // resizemux must be held
+    size_t kept(0);
+    for (auto r : retired) {
+      if (hazard::published(r))
+        retired[kept++] = r;
+      else
+        deletering(r); // drained, the elements are gone
+    }
+    retired.resize(kept);
+  }
+
+  allocator alloc;
+  alignas(TRAITS::CachelineSize) std::atomic<ring *> head; // consumers' ring
+  alignas(TRAITS::CachelineSize) std::atomic<ring *> tail; // producers' ring
+  alignas(TRAITS::CachelineSize) std::atomic<size_t> capacity;
+  std::mutex resizemux;       // guards resize and retired
+  std::vector<ring *> retired; // unlinked, waiting for the readers to leave
+  char cacheline_padding[TRAITS::CachelineSize];
+};
+} // namespace async
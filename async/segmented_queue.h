@@ -0,0 +1,250 @@
+/////////////////////////////////////////////////////////////////////
+//          Copyright Yibo Zhu 2017
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+/////////////////////////////////////////////////////////////////////
+#pragma once
+#include "hazard.h"
+#include "utility.h"
+#include <atomic>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+namespace async {
+struct segmented_traits {
+  static constexpr size_t SegmentSize = 1024; // # of cells per segment
+  static constexpr size_t CachelineSize = 64;
+};
+
+// unbounded mpmc queue made of linked array segments (FAA array queue, the
+// LCRQ family), producers and consumers claim cells with fetch_add on the
+// segment's indexes instead of retrying CAS on a shared index, so they
+// don't fail on each other under contention. a full segment is followed by
+// a new one, a drained segment is recycled once no thread refers to it
+// (hazard pointers, a store per operation, no shared counter). segments are
+// never freed before the queue is destroyed (type-stable)
+template <typename T, typename TRAITS = segmented_traits>
+class segmented_queue final {
+  static_assert(std::is_nothrow_destructible<T>::value,
+                "T must be nothrow destructible");
+  static_assert(TRAITS::SegmentSize > 0, "SegmentSize must be > 0");
+
+public:
+  static constexpr size_t cacheline_size = TRAITS::CachelineSize;
+  static constexpr uint64_t segment_size = TRAITS::SegmentSize;
+
+  // size: # of elements to pre-allocate segments for
+  explicit segmented_queue(size_t size = 0) : poollocked(false) {
+    auto seg = newsegment();
+    head.store(seg, std::memory_order_relaxed);
+    tail.store(seg, std::memory_order_relaxed);
+    for (size_t i = segment_size; i < size; i += segment_size)
+      freesegments.push_back(newsegment());
+  }
+
+  segmented_queue(segmented_queue const &) = delete;
+  segmented_queue(segmented_queue &&) = delete;
+  segmented_queue &operator=(segmented_queue const &) = delete;
+  segmented_queue &operator=(segmented_queue &&) = delete;
+
+  ~segmented_queue() {
+    for (auto seg = head.load(std::memory_order_relaxed); seg != nullptr;
+         seg = seg->next.load(std::memory_order_relaxed))
+      seg->clear();
+  }
+
+  // if T's constructor throws, the exception is propagated, and the claimed
+  // cell is skipped by consumers
+  template <typename... Args> void enqueue(Args &&... args) {
+    hazard::guard<segment> g;
+    for (;;) {
+      auto seg = g.protect(tail);
+      auto idx = seg->enqidx.fetch_add(1, std::memory_order_acq_rel);
+      if (idx < segment_size) {
+        auto &c = seg->cells[idx];
+        uint8_t empty = EMPTY;
+        if (c.state.compare_exchange_strong(empty, WRITING,
+                                            std::memory_order_acquire,
+                                            std::memory_order_relaxed)) {
+          publish(c, std::forward<Args>(args)...);
+          return;
+        }
+        continue; // skipped by a consumer, try the next cell
+      }
+      auto next = seg->next.load(std::memory_order_acquire);
+      if (next == nullptr) { // segment is full, append a new one
+        auto newseg = allocsegment();
+        newseg->enqidx.store(1, std::memory_order_relaxed);
+        newseg->cells[0].state.store(WRITING, std::memory_order_relaxed);
+        if (seg->next.compare_exchange_strong(next, newseg,
+                                              std::memory_order_acq_rel,
+                                              std::memory_order_acquire)) {
+          auto expected = seg;
+          tail.compare_exchange_strong(expected, newseg);
+          publish(newseg->cells[0], std::forward<Args>(args)...);
+          return;
+        }
+        freesegment(newseg); // lost the race, never published
+      }
+      auto expected = seg;
+      tail.compare_exchange_strong(expected, next); // help moving the tail
+    }
+  }
+
+  template <typename U> bool dequeue(U &data) { // false if queue is empty
+    hazard::guard<segment> g;
+    for (;;) {
+      auto seg = g.protect(head);
+      if (seg->deqidx.load(std::memory_order_acquire) >=
+              seg->enqidx.load(std::memory_order_acquire) &&
+          seg->next.load(std::memory_order_acquire) == nullptr)
+        return false;
+      auto idx = seg->deqidx.fetch_add(1, std::memory_order_acq_rel);
+      if (idx >= segment_size) { // drained, move on to the next segment
+        auto next = seg->next.load(std::memory_order_acquire);
+        if (next == nullptr)
+          return false;
+        auto expected = seg;
+        if (head.compare_exchange_strong(expected, next)) {
+          g.reset();
+          retire(seg, next);
+        }
+        continue;
+      }
+      auto &c = seg->cells[idx];
+      uint8_t state = c.state.load(std::memory_order_acquire);
+      if (state == EMPTY &&
+          c.state.compare_exchange_strong(state, TAKEN,
+                                          std::memory_order_acq_rel,
+                                          std::memory_order_acquire))
+        continue; // producer hasn't come yet, it will skip this cell
+      for (; state == WRITING; state = c.state.load(std::memory_order_acquire))
+        cpu_relax(); // producer is constructing the element
+      if (state == READY) {
+        c.move(data);
+        c.state.store(TAKEN, std::memory_order_release);
+        return true;
+      }
+      // INVALID, constructor threw
+    }
+  }
+
+private:
+  enum : uint8_t { EMPTY = 0, WRITING, READY, TAKEN, INVALID };
+
+  struct cell {
+    cell() : state(EMPTY) {}
+    template <typename... Args> inline void construct(Args &&... args) {
+      new (&storage) T(std::forward<Args>(args)...);
+    }
+    inline void destruct() noexcept { reinterpret_cast<T *>(&storage)->~T(); }
+    template <typename U> inline void move(U &data) {
+      data = std::move(*reinterpret_cast<T *>(&storage));
+      destruct();
+    }
+    std::atomic<uint8_t> state;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+  };
+
+  struct segment {
+    segment() : enqidx(0), deqidx(0), next(nullptr) {}
+    void reset() {
+      for (auto &c : cells)
+        c.state.store(EMPTY, std::memory_order_relaxed);
+      enqidx.store(0, std::memory_order_relaxed);
+      deqidx.store(0, std::memory_order_relaxed);
+      next.store(nullptr, std::memory_order_release);
+    }
+    void clear() { // destroy the elements left
+      for (auto &c : cells)
+        if (c.state.load(std::memory_order_relaxed) == READY) {
+          c.destruct();
+          c.state.store(TAKEN, std::memory_order_relaxed);
+        }
+    }
+    std::atomic<uint64_t> enqidx;
+    char cacheline_padding1[cacheline_size];
+    std::atomic<uint64_t> deqidx;
+    char cacheline_padding2[cacheline_size];
+    std::atomic<segment *> next;
+    char cacheline_padding3[cacheline_size];
+    cell cells[TRAITS::SegmentSize];
+  };
+
+  template <typename... Args>
+  inline void publish(cell &c, Args &&... args) {
+    try {
+      c.construct(std::forward<Args>(args)...);
+    } catch (...) {
+      c.state.store(INVALID, std::memory_order_release);
+      throw;
+    }
+    c.state.store(READY, std::memory_order_release);
+  }
+
+  // called by the consumer which moved the head past seg, once both head
+  // and tail are past seg, no one can protect it again, it's recycled when
+  // the threads which did are done with it
+  void retire(segment *seg, segment *next) {
+    auto expected = seg;
+    tail.compare_exchange_strong(expected, next);
+    lockpool();
+    retired.push_back(seg);
+    size_t kept(0);
+    for (auto r : retired) {
+      if (hazard::published(r))
+        retired[kept++] = r;
+      else
+        freesegments.push_back(r);
+    }
+    retired.resize(kept);
+    unlockpool();
+  }
+
+  segment *newsegment() {
+    lockpool();
+    segments.push_back(std::make_unique<segment>());
+    auto seg = segments.back().get();
+    unlockpool();
+    return seg;
+  }
+
+  segment *allocsegment() {
+    lockpool();
+    if (freesegments.empty()) {
+      unlockpool();
+      return newsegment();
+    }
+    auto seg = freesegments.back();
+    freesegments.pop_back();
+    unlockpool();
+    seg->reset();
+    return seg;
+  }
+
+  void freesegment(segment *seg) {
+    lockpool();
+    freesegments.push_back(seg);
+    unlockpool();
+  }
+
+  inline void lockpool() {
+    while (poollocked.load(std::memory_order_relaxed) ||
+           poollocked.exchange(true, std::memory_order_acquire))
+      cpu_relax();
+  }
+  inline void unlockpool() {
+    poollocked.store(false, std::memory_order_release);
+  }
+
+  alignas(cacheline_size) std::atomic<segment *> head;
+  alignas(cacheline_size) std::atomic<segment *> tail;
+  alignas(cacheline_size) std::atomic<bool> poollocked;
+  std::vector<std::unique_ptr<segment>> segments; // owns all segments
+  std::vector<segment *> freesegments;
+  std::vector<segment *> retired; // unlinked, waiting for the readers
+  char cacheline_padding[cacheline_size];
+};
+} // namespace async
@@ -0,0 +1,315 @@
+/////////////////////////////////////////////////////////////////////
+//          Copyright Yibo Zhu 2017
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+/////////////////////////////////////////////////////////////////////
+#pragma once
+#include "bounded_queue.h"
+#include "eventcount.h"
+#include "utility.h"
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#error shm_bounded_queue needs linux (memfd, futex)
+#endif
+
+namespace async {
+// bounded_queue for processes sharing memory, a POSIX shared memory object
+// (/dev/shm) or a memfd. the mapping holds a versioned header, then the
+// ring, and no pointer, so each process can map it at its own address. the
+// elements are copied in and out, T must be trivially copyable, and mean
+// the same to each process (no pointers). the waits sleep on futexes shared
+// by the processes. a process dying in the middle of an operation leaves
+// its slot claimed, the queue stalls there
+template <typename T> class shm_bounded_queue {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "T must be trivially copyable");
+  static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+                "the shared atomics must be lock-free");
+
+public:
+  static constexpr uint64_t magic = 0x4d48535f434e5341; // "ASNC_SHM"
+  static constexpr uint32_t version = 1; // bumped when the layout changes
+  static constexpr size_t cacheline_size = 64;
+  using seq_t = uint64_t;
+
+  // a new queue of size elements in the shared memory object name (e.g.
+  // "/quotes" for /dev/shm/quotes), std::system_error (EEXIST) if the name
+  // exists, unlink() it first to replace it, its processes keep it
+  static shm_bounded_queue create(std::string const &name, size_t size) {
+    auto fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+      throw std::system_error(errno, std::generic_category(),
+                              ERROR_MSG("shm_open " + name));
+    try {
+      return shm_bounded_queue(fd, size);
+    } catch (...) {
+      shm_unlink(name.c_str());
+      throw;
+    }
+  }
+
+  // a new queue of size elements in a memfd, inherited by the children
+  // (also over exec), or sent over a unix socket (SCM_RIGHTS), see fd()
+  static shm_bounded_queue create_anonymous(size_t size) {
+    auto fd =
+        static_cast<int>(syscall(SYS_memfd_create, "shm_bounded_queue", 0));
+    if (fd < 0)
+      throw std::system_error(errno, std::generic_category(),
+                              ERROR_MSG("memfd_create"));
+    return shm_bounded_queue(fd, size);
+  }
+
+  // the queue created under name by another process
+  static shm_bounded_queue attach(std::string const &name) {
+    auto fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0)
+      throw std::system_error(errno, std::generic_category(),
+                              ERROR_MSG("shm_open " + name));
+    return shm_bounded_queue(fd);
+  }
+
+  // the queue in the shared memory of fd, which is duplicated
+  static shm_bounded_queue attach(int fd) {
+    auto dupfd = dup(fd);
+    if (dupfd < 0)
+      throw std::system_error(errno, std::generic_category(),
+                              ERROR_MSG("dup"));
+    return shm_bounded_queue(dupfd);
+  }
+
+  // remove the name, the queue lives on until its last process unmaps it
+  static bool unlink(std::string const &name) {
+    return shm_unlink(name.c_str()) == 0;
+  }
+
+  shm_bounded_queue(shm_bounded_queue &&other) noexcept
+      : base(other.base), bytes(other.bytes), fdesc(other.fdesc),
+        ring(other.ring) {
+    other.base = nullptr;
+    other.fdesc = -1;
+  }
+  shm_bounded_queue &operator=(shm_bounded_queue &&other) noexcept {
+    if (this != &other) {
+      unmap();
+      base = other.base;
+      bytes = other.bytes;
+      fdesc = other.fdesc;
+      ring = other.ring;
+      other.base = nullptr;
+      other.fdesc = -1;
+    }
+    return *this;
+  }
+  shm_bounded_queue(shm_bounded_queue const &) = delete;
+  shm_bounded_queue &operator=(shm_bounded_queue const &) = delete;
+  ~shm_bounded_queue() { unmap(); }
+
+  size_t size() const { return ring.modulo.qsize; }
+  int fd() const { return fdesc; }
+
+  bool enqueue(T const &data) noexcept {
+    auto &h = hdr();
+    seq_t tkt(0);
+    auto s = claimticket(ring, h.enqueueIx, static_cast<seq_t>(0), tkt);
+    if (s == nullptr)
+      return false; // queue is full
+    std::memcpy(&s->storage, &data, sizeof(T));
+    s->tkt.store(tkt + 1, std::memory_order_release);
+    h.notempty.notify_one();
+    return true;
+  }
+
+  bool dequeue(T &data) noexcept {
+    auto &h = hdr();
+    seq_t tkt(0);
+    auto s = claimticket(ring, h.dequeueIx, static_cast<seq_t>(1), tkt);
+    if (s == nullptr)
+      return false; // queue is empty
+    std::memcpy(&data, &s->storage, sizeof(T));
+    s->tkt.store(tkt + 1, std::memory_order_release);
+    h.notfull.notify_one();
+    return true;
+  }
+
+  // block until an element is dequeued, false if the queue is closed and
+  // drained
+  bool wait_dequeue(T &data) {
+    return hdr().notempty.await([&]() { return dequeue(data); },
+                                [this]() { return closed(); }) ==
+           wait_status::ready;
+  }
+
+  template <typename Rep, typename Period>
+  wait_status wait_dequeue_for(T &data,
+                               std::chrono::duration<Rep, Period> const &timeout) {
+    return hdr().notempty.await_until([&]() { return dequeue(data); },
+                                      [this]() { return closed(); },
+                                      std::chrono::steady_clock::now() +
+                                          timeout);
+  }
+
+  // wait for a free slot, closed if the queue is closed (nothing enqueued)
+  template <typename Rep, typename Period>
+  wait_status wait_enqueue_for(std::chrono::duration<Rep, Period> const &timeout,
+                               T const &data) {
+    bool done(false);
+    auto status = hdr().notfull.await_until(
+        [&]() { return !closed() && (done = enqueue(data)); },
+        [this]() { return closed(); },
+        std::chrono::steady_clock::now() + timeout);
+    return done ? wait_status::ready : status;
+  }
+
+  // seen by all the processes, see bounded_queue::close()
+  void close() noexcept {
+    auto &h = hdr();
+    h.closedflag.store(1, std::memory_order_seq_cst);
+    h.notempty.notify_all();
+    h.notfull.notify_all();
+  }
+  bool closed() const noexcept {
+    return hdr().closedflag.load(std::memory_order_seq_cst) != 0;
+  }
+
+private:
+  struct slot {
+    std::atomic<seq_t> tkt;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+  };
+
+  // at offset 0 of the mapping, the ring follows at offset slots
+  struct header {
+    header(size_t size)
+        : magic_(magic), version_(version), ready(0), capacity(size),
+          elementsize(sizeof(T)), elementalign(alignof(T)),
+          slotsize(sizeof(slot)), slots(slotsoffset()), enqueueIx(0),
+          dequeueIx(0), notempty(true), notfull(true), closedflag(0) {}
+    uint64_t const magic_;
+    uint32_t const version_;
+    std::atomic<uint32_t> ready; // 1 once the ring is initialized
+    uint64_t const capacity;
+    uint64_t const elementsize;
+    uint64_t const elementalign;
+    uint64_t const slotsize;
+    uint64_t const slots;
+    alignas(cacheline_size) std::atomic<seq_t> enqueueIx;
+    alignas(cacheline_size) std::atomic<seq_t> dequeueIx;
+    alignas(cacheline_size) eventcount notempty;
+    eventcount notfull;
+    std::atomic<uint32_t> closedflag;
+  };
+
+  static constexpr size_t slotsoffset() {
+    return (sizeof(header) + cacheline_size - 1) / cacheline_size *
+           cacheline_size;
+  }
+
+  // the ring as mapped by this process, its size is read from the header
+  // once, and validated, so a peer writing over the header can't send this
+  // process out of the mapping
+  struct localring {
+    localring(char *base, size_t size)
+        : modulo(size),
+          slots(reinterpret_cast<slot *>(base + slotsoffset())) {}
+    inline slot &slotof(seq_t const seq) { return slots[modulo.slot(seq)]; }
+    inline seq_t ticket(seq_t const seq) const { return modulo.ticket(seq); }
+    ringmodulo<seq_t> modulo;
+    slot *slots;
+  };
+
+  // create, fd is owned
+  shm_bounded_queue(int fd, size_t size)
+      : base(nullptr), bytes(slotsoffset() + sizeof(slot) * size), fdesc(fd),
+        ring(nullptr, 0) {
+    assert(size > 0); // any size <= 0 is illegal
+    if (ftruncate(fd, static_cast<off_t>(bytes)) != 0)
+      fail("ftruncate");
+    map();
+    auto h = new (base) header(size);
+    ring = localring(base, size);
+    for (size_t i = 0; i < size; ++i) // the ring is 0 filled
+      new (&ring.slots[i].tkt) std::atomic<seq_t>(0);
+    h->ready.store(1, std::memory_order_release);
+  }
+
+  // attach, fd is owned
+  explicit shm_bounded_queue(int fd)
+      : base(nullptr), bytes(0), fdesc(fd), ring(nullptr, 0) {
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+      fail("fstat");
+    bytes = static_cast<size_t>(st.st_size);
+    if (bytes < slotsoffset())
+      invalid("not a shm_bounded_queue");
+    map();
+    auto &h = hdr();
+    if (h.ready.load(std::memory_order_acquire) != 1 || h.magic_ != magic)
+      invalid("not a shm_bounded_queue, or not initialized yet");
+    if (h.version_ != version)
+      invalid("shm_bounded_queue version " + std::to_string(h.version_) +
+              ", expected " + std::to_string(version));
+    if (h.elementsize != sizeof(T) || h.elementalign != alignof(T) ||
+        h.slotsize != sizeof(slot) || h.slots != slotsoffset())
+      invalid("shm_bounded_queue of another element type");
+    uint64_t capacity = h.capacity; // read once
+    if (capacity == 0 || capacity > (bytes - slotsoffset()) / sizeof(slot))
+      invalid("shm_bounded_queue truncated");
+    ring = localring(base, static_cast<size_t>(capacity));
+  }
+
+  void map() {
+    auto ptr =
+        mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fdesc, 0);
+    if (ptr == MAP_FAILED)
+      fail("mmap");
+    base = static_cast<char *>(ptr);
+  }
+
+  void unmap() noexcept {
+    if (base != nullptr)
+      munmap(base, bytes);
+    if (fdesc >= 0)
+      ::close(fdesc);
+    base = nullptr;
+    fdesc = -1;
+  }
+
+  void fail(char const *what) {
+    auto err = errno;
+    unmap();
+    throw std::system_error(err, std::generic_category(), ERROR_MSG(what));
+  }
+
+  void invalid(std::string const &what) {
+    unmap();
+    throw std::runtime_error(ERROR_MSG(what));
+  }
+
+  inline header &hdr() const noexcept {
+    return *reinterpret_cast<header *>(base);
+  }
+
+  char *base;   // of the mapping, differs by process
+  size_t bytes; // mapped
+  int fdesc;
+  localring ring;
+};
+} // namespace async
@@ -0,0 +1,123 @@
+/////////////////////////////////////////////////////////////////////
+//          Copyright Yibo Zhu 2017
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+/////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "utility.h"
+#include <atomic>
+#include <cassert>
+#include <type_traits>
+
+namespace async {
+
+struct spsc_traits {
+  static constexpr size_t CachelineSize = 64;
+  using sequence_type = uint64_t;
+};
+
+// single-producer single-consumer bounded queue, same ticket scheme as
+// bounded_queue, but each index has one owner, so no CAS is needed: the
+// producer only checks the ticket of its next slot, the consumer likewise.
+// only one thread may enqueue and only one thread may dequeue at a time
+template <typename T, typename TRAITS = spsc_traits> class spsc_queue {
+private:
+  static_assert(std::is_nothrow_destructible<T>::value,
+                "T must be nothrow destructible");
+
+public:
+  static constexpr size_t cacheline_size = TRAITS::CachelineSize;
+  using seq_t = typename TRAITS::sequence_type;
+  explicit spsc_queue(size_t size)
+      : fastmodulo((size > 0 && ((size & (size - 1)) == 0))),
+        bitshift(fastmodulo ? getShiftBitsCount(size) : 0),
+        elements(new element[size]), mask(fastmodulo ? size - 1 : 0),
+        qsize(size), enqueueIx(0), dequeueIx(0) {
+    assert(qsize > 0); // any size <= 0 is illegal
+  }
+  spsc_queue(spsc_queue const &) = delete;
+  spsc_queue(spsc_queue &&) = delete;
+  spsc_queue &operator=(spsc_queue const &) = delete;
+  spsc_queue &operator=(spsc_queue &&) = delete;
+  ~spsc_queue() { delete[] elements; }
+  size_t size() { return qsize; }
+
+  // producer only, return false if queue is full
+  template <typename... Args> inline bool enqueue(Args &&... args) {
+    auto &ele = elements[index(enqueueIx)];
+    seq_t enq_tkt = ticket(enqueueIx);
+    if (ele.tkt.load(std::memory_order_acquire) != enq_tkt)
+      return false; // queue is full
+    ele.construct(std::forward<Args>(args)...);
+    ele.tkt.store(enq_tkt + 1, std::memory_order_release);
+    ++enqueueIx;
+    return true;
+  }
+
+  // consumer only, return false if queue is empty
+  template <typename U> inline bool dequeue(U &data) {
+    auto &ele = elements[index(dequeueIx)];
+    seq_t deq_tkt = ticket(dequeueIx) + 1;
+    if (ele.tkt.load(std::memory_order_acquire) != deq_tkt)
+      return false; // queue is empty
+    ele.move(data);
+    ele.tkt.store(deq_tkt + 1, std::memory_order_release);
+    ++dequeueIx;
+    return true;
+  }
+
+  // consumer only
+  inline bool empty() {
+    return elements[index(dequeueIx)].tkt.load(std::memory_order_acquire) !=
+           ticket(dequeueIx) + 1;
+  }
+
+private:
+  inline seq_t index(seq_t const seq) {
+    if (fastmodulo)
+      return seq & mask;
+    else
+      return seq >= qsize ? seq % qsize : seq;
+  }
+
+  inline seq_t ticket(seq_t const seq) {
+    if (fastmodulo)
+      return (seq >> bitshift) << 1;
+    else
+      return (seq / static_cast<seq_t>(qsize)) << 1;
+  }
+
+  struct element {
+    element() : tkt(0) {}
+    ~element() {
+      if (tkt & 1) // enqueued but not dequeued
+        destruct();
+    }
+    template <typename... Args> inline void construct(Args &&... args) {
+      new (&storage) T(std::forward<Args>(args)...);
+    }
+    inline void destruct() noexcept { reinterpret_cast<T *>(&storage)->~T(); }
+    inline T *getptr() { return reinterpret_cast<T *>(&storage); }
+    template <typename U> inline void move(U &data) {
+      data = std::move(*getptr());
+      destruct();
+    }
+    std::atomic<seq_t> tkt;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+  };
+
+  bool const fastmodulo;   // true if qsize is power of 2
+  int const bitshift;      // used if fastmodulo is true
+  element *const elements; // pointer to buffer
+  size_t const mask;       // used if fastmodulo is true
+  size_t const qsize;      // queue size
+  alignas(cacheline_size) char cacheline_padding1[cacheline_size];
+  alignas(cacheline_size) seq_t enqueueIx; // owned by the producer
+  alignas(cacheline_size) char cacheline_padding2[cacheline_size];
+  alignas(cacheline_size) seq_t dequeueIx; // owned by the consumer
+  alignas(cacheline_size) char cacheline_padding3[cacheline_size];
+};
+} // namespace async
@@ -5,13 +5,18 @@
 //          http://www.boost.org/LICENSE_1_0.txt)
 /////////////////////////////////////////////////////////////////////
 #pragma once
+#include "bounded_queue.h"
 #include "queue.h"
+#include "relaxed_priority_queue.h"
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <functional>
 #include <future>
 #include <iterator>
 #include <memory>
 #include <mutex>
+#include <stdexcept>
 #include <thread>
 #include <vector>
 namespace async {
@@ -20,9 +25,24 @@ namespace async {
 class threadpool final {
 public:
   static int defaultpoolsize() { return std::thread::hardware_concurrency(); }
+  using deadline_clock = std::chrono::steady_clock;
+  using expired_handler = std::function<void(deadline_clock::time_point)>;
+  static constexpr size_t maxtenants = 256;
+  static constexpr size_t localringsize = 256; // per-worker inbox capacity
+
+  struct tenant_metrics {
+    unsigned weight;    // # of tasks run per round
+    uint64_t submitted; // # of tasks posted
+    uint64_t executed;  // # of tasks picked up by workers
+    double share;       // executed / executed of all tenants
+  };
 
   threadpool(int poolsize = static_cast<int>(defaultpoolsize()))
-      : idlecount(0), conflag(false) {
+      : deadlinetasks(2 * static_cast<size_t>(
+                              std::max(poolsize, defaultpoolsize()))),
+        tenantcount(1), rrcursor(0), workercount(0), watcher(false),
+        idlecount(0), gracems(mingracems), conflag(false) {
+    tenants[0] = std::make_unique<tenant>(1); // default tenant
     configurepool(poolsize);
   }
 
@@ -83,12 +103,7 @@ public:
     auto taskptr = std::make_shared<
         std::packaged_task<typename std::result_of<Func(Args...)>::type()>>(
         std::bind(std::forward<Func>(func), std::forward<Args>(args)...));
-    taskqueue.enqueue([taskptr]() { (*taskptr)(); });
-    {
-      std::lock_guard<std::mutex> lg(qcvmux);
-      conflag = true;
-    }
-    qcv.notify_one();
+    submit([taskptr]() { (*taskptr)(); });
     return taskptr->get_future();
   }
 
@@ -103,7 +118,42 @@ public:
     auto taskptr = std::make_shared<
         std::packaged_task<typename std::result_of<Func()>::type()>>(
         std::forward<Func>(func));
-    taskqueue.enqueue([taskptr]() { (*taskptr)(); });
+    submit([taskptr]() { (*taskptr)(); });
+    return taskptr->get_future();
+  }
+
+  // fire-and-forget, no future (and no packaged_task) is created, func must
+  // not throw
+  template <typename Func> inline void execute(Func &&func) {
+    submit(std::function<void()>(std::forward<Func>(func)));
+  }
+
+  // like execute, but always queued behind the tasks already posted, even
+  // when called from a worker (which would run it next from its LIFO slot)
+  template <typename Func> inline void defer(Func &&func) {
+    share(std::function<void()>(std::forward<Func>(func)));
+  }
+
+  // earliest-deadline-first task, workers pick the pending deadline task with
+  // the nearest deadline (approximately, see relaxed_priority_queue) before
+  // any task submitted by post, but one posted task (if any) goes after each
+  // run of maxdeadlinestreak deadline tasks. a task whose deadline has passed
+  // when it's picked is dropped without being run, its future reports
+  // std::future_errc::broken_promise, and the expired handler (if any) is
+  // called with the missed deadline. time_point::max() is a valid deadline
+  template <typename Func, typename... Args>
+  inline auto post_with_deadline(deadline_clock::time_point deadline,
+                                 Func &&func, Args &&... args)
+#if ((defined(__clang__) || defined(__GNUC__)) && __cplusplus <= 201103L) ||   \
+    (defined(_MSC_VER) && _MSC_VER <= 1800)
+      -> std::future<typename std::result_of<Func(Args...)>::type>
+#endif
+  {
+    auto taskptr = std::make_shared<
+        std::packaged_task<typename std::result_of<Func(Args...)>::type()>>(
+        std::bind(std::forward<Func>(func), std::forward<Args>(args)...));
+    deadlinetasks.push(deadline.time_since_epoch().count(),
+                       [taskptr]() { (*taskptr)(); });
     {
       std::lock_guard<std::mutex> lg(qcvmux);
       conflag = true;
@@ -112,17 +162,182 @@ public:
     return taskptr->get_future();
   }
 
+  // register a tenant, tenants share the workers by deficit round robin,
+  // each gets up to weight tasks run per round when it has tasks pending,
+  // so a busy tenant can't monopolize the pool. tenant 0 is the default
+  // tenant used by post. returns the id for post_for_tenant
+  size_t addtenant(unsigned weight = 1) {
+    std::lock_guard<std::mutex> lg(poolmux);
+    auto id = tenantcount.load(std::memory_order_relaxed);
+    if (id >= maxtenants)
+      throw std::length_error(ERROR_MSG("too many tenants"));
+    tenants[id] = std::make_unique<tenant>(std::max(weight, 1u));
+    tenantcount.store(id + 1, std::memory_order_release);
+    return id;
+  }
+
+  void configuretenant(size_t id, unsigned weight) {
+    gettenant(id).weight.store(std::max(weight, 1u),
+                               std::memory_order_relaxed);
+  }
+
+  template <typename Func, typename... Args>
+  inline auto post_for_tenant(size_t id, Func &&func, Args &&... args)
+#if ((defined(__clang__) || defined(__GNUC__)) && __cplusplus <= 201103L) ||   \
+    (defined(_MSC_VER) && _MSC_VER <= 1800)
+      -> std::future<typename std::result_of<Func(Args...)>::type>
+#endif
+  {
+    auto &t = gettenant(id);
+    auto taskptr = std::make_shared<
+        std::packaged_task<typename std::result_of<Func(Args...)>::type()>>(
+        std::bind(std::forward<Func>(func), std::forward<Args>(args)...));
+    t.enqueue([taskptr]() { (*taskptr)(); });
+    {
+      std::lock_guard<std::mutex> lg(qcvmux);
+      conflag = true;
+    }
+    qcv.notify_one();
+    return taskptr->get_future();
+  }
+
+  tenant_metrics tenantmetrics(size_t id) {
+    auto &t = gettenant(id);
+    uint64_t total(0);
+    for (size_t i = 0, n = tenantcount.load(std::memory_order_acquire); i < n;
+         ++i)
+      total += tenants[i]->executed.load(std::memory_order_relaxed);
+    tenant_metrics m;
+    m.weight = t.weight.load(std::memory_order_relaxed);
+    m.submitted = t.submitted.load(std::memory_order_relaxed);
+    m.executed = t.executed.load(std::memory_order_relaxed);
+    m.share = total ? static_cast<double>(m.executed) / total : 0.0;
+    return m;
+  }
+
+  // called by the worker which drops an expired deadline task
+  void set_expired_handler(expired_handler handler) {
+    std::atomic_store(&expiredhandler,
+                      std::make_shared<expired_handler>(std::move(handler)));
+  }
+
 private:
+  struct tenant {
+    explicit tenant(unsigned w)
+        : weight(w), deficit(0), submitted(0), executed(0) {}
+    template <typename Task> inline void enqueue(Task &&task) {
+      submitted.fetch_add(1, std::memory_order_relaxed);
+      tasks.enqueue(std::forward<Task>(task));
+    }
+    std::atomic<unsigned> weight;  // quantum, # of tasks per round
+    std::atomic<int64_t> deficit;  // tasks left in current round
+    std::atomic<uint64_t> submitted, executed;
+    async::queue<std::function<void()>> tasks;
+  };
+
+  tenant &gettenant(size_t id) {
+    if (id >= tenantcount.load(std::memory_order_acquire))
+      throw std::out_of_range(ERROR_MSG("unknown tenant"));
+    return *tenants[id];
+  }
+
+  // per-worker inbox for tasks posted by the worker itself, the latest one
+  // sits in the LIFO slot and runs next on the same (cache-hot) worker, the
+  // older ones go to a small ring, and spill to the shared queue when it's
+  // full. only the owner fills it, an idle worker takes the tasks over if the
+  // owner makes no progress for a grace period (e.g. blocked in a task)
+  struct worker {
+    explicit worker(threadpool &pool)
+        : thpool(pool), slot(1), ring(localringsize), localcount(0),
+          ticks(0), watchedticks(0), localstreak(0), deadlinestreak(0) {}
+
+    // true if the inbox was empty
+    inline bool push(std::function<void()> &&task) {
+      std::function<void()> older;
+      auto wasempty = localcount.fetch_add(1, std::memory_order_relaxed) == 0;
+      if (slot.dequeue(older) && !ring.enqueue(std::move(older))) {
+        localcount.fetch_sub(1, std::memory_order_relaxed);
+        thpool.share(std::move(older));
+      }
+      if (!slot.enqueue(std::move(task)) && // slot is being taken over
+          !ring.enqueue(std::move(task))) {
+        localcount.fetch_sub(1, std::memory_order_relaxed);
+        thpool.share(std::move(task));
+      }
+      return wasempty;
+    }
+
+    inline bool pop(std::function<void()> &task) {
+      if (localcount.load(std::memory_order_relaxed) == 0 ||
+          !(slot.dequeue(task) || ring.dequeue(task)))
+        return false;
+      localcount.fetch_sub(1, std::memory_order_relaxed);
+      return true;
+    }
+
+    size_t flush() { // move all tasks to the shared queue
+      std::function<void()> task;
+      size_t count(0);
+      for (; pop(task); ++count)
+        thpool.tenants[0]->enqueue(std::move(task));
+      return count;
+    }
+
+    threadpool &thpool;
+    async::bounded_queue<std::function<void()>> slot; // LIFO slot
+    async::bounded_queue<std::function<void()>> ring;
+    std::atomic<size_t> localcount; // # of tasks in slot and ring
+    std::atomic<uint64_t> ticks;    // # of tasks picked, owner only
+    uint64_t watchedticks;          // ticks seen by the watcher
+    unsigned localstreak;           // consecutive local picks, owner only
+    unsigned deadlinestreak;        // consecutive deadline picks, owner only
+  };
+
+  static worker *&currentworker() {
+    static thread_local worker *w = nullptr;
+    return w;
+  }
+
+  template <typename Task> inline void submit(Task &&task) {
+    auto w = currentworker();
+    if (w != nullptr && &w->thpool == this) { // posted by own worker
+      // the first local task wakes up an idle worker to watch it. under the
+      // lock, an idle worker which just found no local task is already
+      // waiting: a missed wakeup would leave the task unwatched, and the
+      // owner may block on its future
+      if (w->push(std::forward<Task>(task))) {
+        std::lock_guard<std::mutex> lg(qcvmux);
+        if (!watcher.load(std::memory_order_relaxed) &&
+            idlecount.load(std::memory_order_relaxed) > 0)
+          qcv.notify_one();
+      }
+      return;
+    }
+    share(std::forward<Task>(task));
+  }
+
+  template <typename Task> inline void share(Task &&task) {
+    tenants[0]->enqueue(std::forward<Task>(task));
+    {
+      std::lock_guard<std::mutex> lg(qcvmux);
+      conflag = true;
+    }
+    qcv.notify_one();
+  }
+
   struct executor {
     executor(std::unique_ptr<std::atomic<bool>> &&ptr, threadpool &pool)
         : stop(std::move(ptr)), thpool(pool) {}
     void operator()() {
+      worker self(thpool);
+      thpool.attach(self);
       while (!*stop) {
-        if (!thpool.executetask_in_loop(*stop)) {
-          return; // signaled to quit
+        if (!thpool.executetask_in_loop(self, *stop)) {
+          break; // signaled to quit
         }
         thpool.wait_for_task(*stop); // wait for new task
       }
+      thpool.detach(self);
     }
 
   private:
@@ -130,6 +345,51 @@ private:
     threadpool &thpool;
   };
 
+  void attach(worker &self) {
+    currentworker() = &self;
+    std::lock_guard<std::mutex> lg(workersmux);
+    workers.push_back(&self);
+    workercount.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void detach(worker &self) {
+    currentworker() = nullptr;
+    {
+      std::lock_guard<std::mutex> lg(workersmux);
+      workers.erase(std::find(workers.begin(), workers.end(), &self));
+      workercount.fetch_sub(1, std::memory_order_relaxed);
+    }
+    if (self.flush() > 0) { // leftovers go to the remaining workers
+      std::lock_guard<std::mutex> lg(qcvmux);
+      conflag = true;
+      qcv.notify_all();
+    }
+  }
+
+  bool haslocaltasks() {
+    std::lock_guard<std::mutex> lg(workersmux);
+    for (auto w : workers)
+      if (w->localcount.load(std::memory_order_relaxed) > 0)
+        return true;
+    return false;
+  }
+
+  // called by the watcher, hand the local tasks of the workers which didn't
+  // pick any task since last check over to the shared queue
+  bool rescuelocaltasks() {
+    size_t rescued(0);
+    std::lock_guard<std::mutex> lg(workersmux);
+    for (auto w : workers) {
+      if (w->localcount.load(std::memory_order_relaxed) == 0)
+        continue;
+      auto ticks = w->ticks.load(std::memory_order_relaxed);
+      if (ticks == w->watchedticks)
+        rescued += w->flush();
+      w->watchedticks = ticks;
+    }
+    return rescued > 0;
+  }
+
   std::atomic<bool> *addthread() {
     auto stopuniptr = std::make_unique<std::atomic<bool>>(false);
     auto stoprawptr = stopuniptr.get();
@@ -163,17 +423,36 @@ private:
     idlecount.fetch_add(1, std::memory_order_relaxed);
     {
       std::unique_lock<std::mutex> lk(qcvmux);
-      qcv.wait(lk, [&]() {
-        return conflag || stop.load(std::memory_order_acquire);
-      }); //memory_oder can be removed
+      while (!conflag && !stop.load(std::memory_order_acquire)) {
+        if (!watcher && haslocaltasks()) {
+          // some workers have local tasks, keep an eye on them. the grace
+          // period doubles when an owner had to be rescued (its tasks run
+          // long, steal less eagerly), and halves back when they all kept
+          // going, so only a worker stuck for long loses its tasks
+          watcher = true;
+          qcv.wait_for(lk, std::chrono::milliseconds(gracems));
+          watcher = false;
+          if (rescuelocaltasks()) {
+            gracems = 2 * gracems < maxgracems ? 2 * gracems : maxgracems;
+            qcv.notify_all();
+            break;
+          }
+          gracems = gracems / 2 > mingracems ? gracems / 2 : mingracems;
+        } else {
+          qcv.wait(lk);
+        }
+      }
       conflag = false;
     }
     idlecount.fetch_sub(1, std::memory_order_relaxed);
   }
 
-  inline bool executetask_in_loop(std::atomic<bool> const &stop) {
+  inline bool executetask_in_loop(worker &self,
+                                  std::atomic<bool> const &stop) {
     std::function<void()> func;
-    for (; taskqueue.dequeue(func);) {
+    for (; nexttask(self, func);) {
+      self.ticks.store(self.ticks.load(std::memory_order_relaxed) + 1,
+                       std::memory_order_relaxed);
       func();
       if (stop) // stop is signaled
         return false;
@@ -181,10 +460,85 @@ private:
     return true;
   }
 
+  inline bool nexttask(worker &self, std::function<void()> &func) {
+    // own tasks first while they're hot, but let shared tasks in regularly
+    if (self.localstreak < maxlocalstreak && self.pop(func)) {
+      ++self.localstreak;
+      return true;
+    }
+    self.localstreak = 0;
+    // deadline tasks next, but a run of them lets a posted task in, so a
+    // steady flow of deadlines doesn't starve the tenants
+    if (self.deadlinestreak < maxdeadlinestreak && nextdeadlinetask(func)) {
+      ++self.deadlinestreak;
+      return true;
+    }
+    self.deadlinestreak = 0;
+    return nexttenanttask(func) || nextdeadlinetask(func) || self.pop(func);
+  }
+
+  inline bool nexttenanttask(std::function<void()> &func) {
+    auto count = tenantcount.load(std::memory_order_acquire);
+    if (count == 1) { // no tenants registered, plain FIFO
+      if (!tenants[0]->tasks.dequeue(func))
+        return false;
+      tenants[0]->executed.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+    // deficit round robin, the tenant under rrcursor is served while it has
+    // credit and tasks, then the cursor moves on and the next tenant gets a
+    // new quantum (weight). an idle tenant forfeits its credit
+    for (size_t visit = 0; visit < 2 * count; ++visit) {
+      auto cursor = rrcursor.load(std::memory_order_acquire);
+      auto &t = *tenants[cursor % count];
+      if (t.deficit.fetch_sub(1, std::memory_order_acq_rel) > 0) {
+        if (t.tasks.dequeue(func)) {
+          t.executed.fetch_add(1, std::memory_order_relaxed);
+          return true;
+        }
+        t.deficit.store(0, std::memory_order_relaxed);
+      }
+      if (rrcursor.compare_exchange_strong(cursor, cursor + 1,
+                                           std::memory_order_acq_rel)) {
+        auto &next = *tenants[(cursor + 1) % count];
+        next.deficit.store(next.weight.load(std::memory_order_relaxed),
+                           std::memory_order_release);
+      }
+    }
+    return false;
+  }
+
+  inline bool nextdeadlinetask(std::function<void()> &func) {
+    deadline_clock::rep deadline;
+    while (!deadlinetasks.empty() && deadlinetasks.try_pop(deadline, func)) {
+      if (deadline_clock::now().time_since_epoch().count() <= deadline)
+        return true;
+      auto handler = std::atomic_load(&expiredhandler);
+      if (handler && *handler)
+        (*handler)(
+            deadline_clock::time_point(deadline_clock::duration(deadline)));
+      func = nullptr; // drop it, the future gets a broken_promise
+    }
+    return false;
+  }
+
   std::vector<std::unique_ptr<std::thread>> threads;
   std::vector<std::atomic<bool> *> tpstops; // threads terminate flags
-  async::queue<std::function<void()>> taskqueue;
+  std::unique_ptr<tenant> tenants[maxtenants]; // [0] is the default tenant
+  async::relaxed_priority_queue<deadline_clock::rep, std::function<void()>>
+      deadlinetasks; // keyed by deadline
+  std::shared_ptr<expired_handler> expiredhandler;
+  std::atomic<size_t> tenantcount;
+  std::atomic<size_t> rrcursor; // DRR position
+  std::vector<worker *> workers; // registered worker inboxes
+  std::mutex workersmux;
+  std::atomic<int> workercount;
+  std::atomic<bool> watcher; // true if an idle worker watches local tasks
+  static constexpr unsigned maxlocalstreak = 32;
+  static constexpr unsigned maxdeadlinestreak = 16;
+  static constexpr unsigned mingracems = 10, maxgracems = 1000;
   std::atomic<int> idlecount; // idle thread count
+  unsigned gracems; // watcher's grace period, guarded by qcvmux
   std::mutex qcvmux, poolmux;
   std::condition_variable qcv;
   bool conflag; // continue flag for cv
@@ -14,6 +14,8 @@
 #include <cstdint>
 #include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 template <typename T> static constexpr T getBitmask(unsigned int const bits) {
   return static_cast<T>(-(bits != 0)) &
          (static_cast<T>(-1) >> ((sizeof(T) * CHAR_BIT) - bits));
@@ -81,7 +83,7 @@ inline std::string getErrorMsg(std::string const &message, char const *file,
 #include <stdlib.h>
 #include <windows.h>
 
-static size_t cache_line_size() {
+inline size_t cache_line_size() {
   size_t line_size = 0;
   DWORD buffer_size = 0;
   DWORD i = 0;
@@ -104,13 +106,13 @@ static size_t cache_line_size() {
 
 #elif defined(__linux__)
 #include <unistd.h>
-static size_t cache_line_size() {
+inline size_t cache_line_size() {
   size_t line_size = sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
   return line_size;
 }
 #elif defined(__APPLE__)
 #include <sys/sysctl.h>
-static size_t cache_line_size() {
+inline size_t cache_line_size() {
   size_t line_size = 0;
   size_t size_of_linesize = sizeof(line_size);
   sysctlbyname("hw.cachelinesize", &line_size, &size_of_linesize, 0, 0);
@@ -119,3 +121,127 @@ static size_t cache_line_size() {
 #else
 #error unsupported platform
 #endif
+
+// pause hint for spin-wait loops
+static inline void cpu_relax() {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+  YieldProcessor();
+#elif (defined(__GNUC__) || defined(__clang__)) &&                              \
+    (defined(__x86_64__) || defined(__i386__))
+  __builtin_ia32_pause();
+#elif (defined(__GNUC__) || defined(__clang__)) &&                              \
+    (defined(__aarch64__) || defined(__arm__))
+  __asm__ __volatile__("yield");
+#endif
+}
+
+// double-width (128-bit) compare-and-swap, cmpxchg16b on x86-64, gcc/clang
+// need -mcx16 for it
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#define ASYNC_HAS_DWCAS 1
+#elif (defined(__GNUC__) || defined(__clang__)) &&                              \
+    defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_16)
+#define ASYNC_HAS_DWCAS 1
+#else
+#define ASYNC_HAS_DWCAS 0
+#endif
+
+#if ASYNC_HAS_DWCAS
+struct alignas(16) dwords {
+  std::uint64_t lo;
+  std::uint64_t hi;
+};
+
+// full barrier, expected is updated with the current value if failed
+static inline bool dwcas(void volatile *dst, dwords &expected,
+                         dwords const &desired) {
+#ifdef _MSC_VER
+  return _InterlockedCompareExchange128(
+             static_cast<long long volatile *>(dst),
+             static_cast<long long>(desired.hi),
+             static_cast<long long>(desired.lo),
+             reinterpret_cast<long long *>(&expected)) != 0;
+#else
+  using u128 = unsigned __int128;
+  auto exp = (static_cast<u128>(expected.hi) << 64) | expected.lo;
+  auto des = (static_cast<u128>(desired.hi) << 64) | desired.lo;
+  auto old = __sync_val_compare_and_swap(static_cast<u128 volatile *>(dst),
+                                         exp, des);
+  if (old == exp)
+    return true;
+  expected.lo = static_cast<std::uint64_t>(old);
+  expected.hi = static_cast<std::uint64_t>(old >> 64);
+  return false;
+#endif
+}
+#endif
+
+// bounded exponential backoff for failed CAS loops, pauses up to 64 times in
+// a row, then yields the cpu, so a preempted thread gets a chance to finish
+class backoff {
+public:
+  inline void pause() {
+    if (count > limit) {
+      std::this_thread::yield();
+      return;
+    }
+    for (unsigned i = 0; i < count; ++i)
+      cpu_relax();
+    count <<= 1;
+  }
+  inline void reset() { count = 1; }
+
+private:
+  static constexpr unsigned limit = 64;
+  unsigned count = 1;
+};
+
+// pin the thread to the given cpu, return false if not supported/allowed
+#ifdef _WIN32
+inline bool set_thread_affinity(std::thread &t, size_t cpu) {
+  if (cpu >= sizeof(DWORD_PTR) * CHAR_BIT)
+    return false;
+  return SetThreadAffinityMask(t.native_handle(), DWORD_PTR(1) << cpu) != 0;
+}
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+inline bool set_thread_affinity(std::thread &t, size_t cpu) {
+  if (cpu >= CPU_SETSIZE)
+    return false;
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  CPU_SET(cpu, &cpuset);
+  return pthread_setaffinity_np(t.native_handle(), sizeof(cpu_set_t),
+                                &cpuset) == 0;
+}
+#else
+inline bool set_thread_affinity(std::thread &, size_t) {
+  return false; // no hard affinity on this platform
+}
+#endif
+
+// the cpus the calling thread is allowed on (its affinity mask, e.g. from a
+// cpuset or taskset), in order, all the cpus if unknown
+inline std::vector<size_t> allowed_cpus() {
+  std::vector<size_t> cpus;
+#ifdef _WIN32
+  DWORD_PTR process(0), system(0);
+  if (GetProcessAffinityMask(GetCurrentProcess(), &process, &system))
+    for (size_t cpu = 0; cpu < sizeof(DWORD_PTR) * CHAR_BIT; ++cpu)
+      if (process & (DWORD_PTR(1) << cpu))
+        cpus.push_back(cpu);
+#elif defined(__linux__)
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  if (sched_getaffinity(0, sizeof(cpu_set_t), &cpuset) == 0)
+    for (size_t cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+      if (CPU_ISSET(cpu, &cpuset))
+        cpus.push_back(cpu);
+#endif
+  if (cpus.empty())
+    for (size_t cpu = 0; cpu < std::thread::hardware_concurrency(); ++cpu)
+      cpus.push_back(cpu);
+  return cpus;
+}
@@ -0,0 +1,185 @@
+/////////////////////////////////////////////////////////////////////
+//          Copyright Yibo Zhu 2017
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+/////////////////////////////////////////////////////////////////////
+#pragma once
+#include "utility.h"
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace async {
+// thin wrappers of the os virtual memory api, all sizes are in bytes, and
+// addresses/sizes passed to commit/decommit/discard should be page aligned
+namespace vmem {
+inline size_t page_size() {
+#ifdef _WIN32
+  static size_t const size = []() {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return static_cast<size_t>(info.dwPageSize);
+  }();
+#else
+  static size_t const size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+  return size;
+}
+
+inline size_t round_up(size_t bytes) {
+  auto page = page_size();
+  return (bytes + page - 1) / page * page;
+}
+
+// reserve address space without backing memory, nullptr if failed
+inline void *reserve(size_t bytes) {
+#ifdef _WIN32
+  return VirtualAlloc(nullptr, bytes, MEM_RESERVE, PAGE_NOACCESS);
+#else
+  auto ptr = mmap(nullptr, bytes, PROT_NONE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return ptr == MAP_FAILED ? nullptr : ptr;
+#endif
+}
+
+// make reserved pages accessible (read/write), backed on first touch
+inline bool commit(void *ptr, size_t bytes) {
+#ifdef _WIN32
+  return VirtualAlloc(ptr, bytes, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else
+  return mprotect(ptr, bytes, PROT_READ | PROT_WRITE) == 0;
+#endif
+}
+
+// give the pages back to the os, they become inaccessible
+inline void decommit(void *ptr, size_t bytes) {
+#ifdef _WIN32
+  VirtualFree(ptr, bytes, MEM_DECOMMIT);
+#else
+  madvise(ptr, bytes, MADV_DONTNEED);
+  mprotect(ptr, bytes, PROT_NONE);
+#endif
+}
+
+// give the physical pages back to the os, but keep them accessible, the
+// content is either kept or zero-filled afterwards (always zero on linux).
+// false if the os refused, e.g. a part of an explicit huge page
+inline bool discard(void *ptr, size_t bytes) {
+#ifdef _WIN32
+  return VirtualAlloc(ptr, bytes, MEM_RESET, PAGE_READWRITE) != nullptr;
+#elif defined(__linux__)
+  return madvise(ptr, bytes, MADV_DONTNEED) == 0;
+#else
+  return madvise(ptr, bytes, MADV_FREE) == 0;
+#endif
+}
+
+inline void release(void *ptr, size_t bytes) {
+#ifdef _WIN32
+  VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+  munmap(ptr, bytes);
+#endif
+}
+
+// page aligned allocation, throw std::bad_alloc if failed. one call,
+// reserved and committed together
+inline void *allocate(size_t bytes) {
+  bytes = round_up(bytes);
+#ifdef _WIN32
+  auto ptr =
+      VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+  if (ptr == nullptr)
+    throw std::bad_alloc();
+#else
+  auto ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED)
+    throw std::bad_alloc();
+#endif
+  return ptr;
+}
+
+inline void deallocate(void *ptr, size_t bytes) {
+  release(ptr, round_up(bytes));
+}
+
+inline size_t huge_page_size() { return static_cast<size_t>(2) << 20; }
+
+// ask for transparent huge pages on the range, no-op if not supported
+inline void advise_huge(void *ptr, size_t bytes) {
+#ifdef MADV_HUGEPAGE
+  madvise(ptr, bytes, MADV_HUGEPAGE);
+#else
+  (void)ptr;
+  (void)bytes;
+#endif
+}
+
+// huge page aligned allocation of round_up(bytes, huge_page_size()), backed
+// by explicit huge pages if the os has some reserved, transparent huge pages
+// otherwise, or by normal pages if neither is available. throw
+// std::bad_alloc if failed, release it by deallocate_huge
+inline void *allocate_huge(size_t bytes) {
+  auto huge = huge_page_size();
+  bytes = (bytes + huge - 1) / huge * huge;
+#ifdef _WIN32
+  auto large = GetLargePageMinimum();
+  if (large > 0 && bytes % large == 0) { // needs SeLockMemoryPrivilege
+    auto ptr = VirtualAlloc(nullptr, bytes,
+                            MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+                            PAGE_READWRITE);
+    if (ptr != nullptr)
+      return ptr;
+  }
+  return allocate(bytes);
+#else
+#ifdef MAP_HUGETLB
+  auto ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (ptr != MAP_FAILED)
+    return ptr;
+#endif
+  // over-allocate and trim, so the range is huge page aligned
+  auto raw = mmap(nullptr, bytes + huge, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED)
+    throw std::bad_alloc();
+  auto begin = reinterpret_cast<uintptr_t>(raw);
+  auto aligned = (begin + huge - 1) / huge * huge;
+  if (aligned > begin)
+    munmap(raw, aligned - begin);
+  if (begin + huge > aligned)
+    munmap(reinterpret_cast<void *>(aligned + bytes), begin + huge - aligned);
+  advise_huge(reinterpret_cast<void *>(aligned), bytes);
+  return reinterpret_cast<void *>(aligned);
+#endif
+}
+
+inline void deallocate_huge(void *ptr, size_t bytes) {
+  auto huge = huge_page_size();
+  release(ptr, (bytes + huge - 1) / huge * huge);
+}
+
+// keep the pages in memory (no major faults), false if not allowed, e.g.
+// over RLIMIT_MEMLOCK
+inline bool lock(void *ptr, size_t bytes) {
+#ifdef _WIN32
+  return VirtualLock(ptr, bytes) != 0;
+#else
+  return mlock(ptr, bytes) == 0;
+#endif
+}
+} // namespace vmem
+} // namespace async
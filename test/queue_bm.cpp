@@ -16,7 +16,9 @@
 
 #include "bounded_queue.h"
 #include "queue.h"
+#include "resizable_bounded_queue.h"
 #include "rlutil.h"
+#include "segmented_queue.h"
 #include <algorithm>
 #include <cassert>
 #include <chrono>
@@ -206,9 +208,34 @@ struct boost_spsc_queue_adapter : public boost::lockfree::spsc_queue<T> {
 };
 #endif
 
+template <typename T, int S = 50000,
+          typename TRAITS = async::bounded_traits>
+struct bounded_queue_adapter : public async::bounded_queue<T, TRAITS> {
+  bounded_queue_adapter(size_t) : async::bounded_queue<T, TRAITS>(S){};
+};
+
 template <typename T, int S = 50000>
-struct bounded_queue_adapter : public async::bounded_queue<T> {
-  bounded_queue_adapter(size_t) : async::bounded_queue<T>(S){};
+struct resizable_bounded_queue_adapter
+    : public async::resizable_bounded_queue<T> {
+  resizable_bounded_queue_adapter(size_t)
+      : async::resizable_bounded_queue<T>(S){};
+};
+
+struct padded_bounded_traits : public async::bounded_traits {
+  static constexpr async::slot_layout SlotLayout = async::slot_layout::padded;
+};
+
+struct spread_bounded_traits : public async::bounded_traits {
+  static constexpr async::slot_layout SlotLayout = async::slot_layout::spread;
+};
+
+template <typename T, size_t S>
+struct static_bounded_queue_adapter : public async::static_bounded_queue<T, S> {
+  static_bounded_queue_adapter(size_t) {}
+};
+
+struct flat_traits : public async::traits {
+  static constexpr uint64_t FlatBits = 32;
 };
 
 void batch_bm(int numProducers, int numConsumers, int const ops, int batches) {
@@ -223,11 +250,33 @@ void batch_bm(int numProducers, int numConsumers, int const ops, int batches) {
 
   benchmark<bounded_queue_adapter<int, 16384>>(
       "async::bounded_queue", numProducers, numConsumers, ops, batches);
+  benchmark<bounded_queue_adapter<int, 16384, padded_bounded_traits>>(
+      "async::bounded_queue (padded)", numProducers, numConsumers, ops,
+      batches);
+  benchmark<bounded_queue_adapter<int, 16384, spread_bounded_traits>>(
+      "async::bounded_queue (spread)", numProducers, numConsumers, ops,
+      batches);
+  benchmark<static_bounded_queue_adapter<int, 16384>>(
+      "async::static_bounded_queue", numProducers, numConsumers, ops, batches);
+  benchmark<resizable_bounded_queue_adapter<int, 16384>>(
+      "async::resizable_bounded_queue", numProducers, numConsumers, ops,
+      batches);
+  benchmark<bounded_queue_adapter<int, 12000>>(
+      "async::bounded_queue (12000)", numProducers, numConsumers, ops, batches);
+  benchmark<static_bounded_queue_adapter<int, 12000>>(
+      "async::static_bounded_queue (12000)", numProducers, numConsumers, ops,
+      batches);
 
   benchmark_bulk<async::queue<int>, 16>("async::queue::bulk", numProducers,
                                         numConsumers, ops, batches);
   benchmark<async::queue<int>>("async::queue", numProducers, numConsumers, ops,
                                batches);
+  benchmark<async::queue<int, flat_traits>>("async::queue (flat)",
+                                            numProducers, numConsumers, ops,
+                                            batches);
+  benchmark<async::segmented_queue<int>>("async::segmented_queue",
+                                         numProducers, numConsumers, ops,
+                                         batches);
 
 #ifdef TEST_BOOST
   benchmark<boost_queue_adapter<int>>("boost::lockfree::queue", numProducers,
@@ -257,5 +306,15 @@ int main() {
     batch_bm(i, threads - i, ops, batches);
     std::cout << std::endl << std::endl;
   }
+
+  // oversubscribed, 4x more threads than cores, preempted threads must not
+  // stall the others
+  rlutil::setColor(rlutil::BLACK);
+  rlutil::setBackgroundColor(rlutil::WHITE);
+  std::cout << "Oversubscribed Benchmark with " << threads * 4 << " threads";
+  rlutil::setBackgroundColor(rlutil::BLACK);
+  std::cout << std::endl;
+  batch_bm(threads * 2, threads * 2, ops, batches / 10);
+  std::cout << std::endl << std::endl;
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,113 @@
+/////////////////////////////////////////////////////////////////////
+//          Copyright Yibo Zhu 2017
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+/////////////////////////////////////////////////////////////////////
+#include "actor.h"
+#include "catch.hpp"
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+struct counter : public async::actor<int> {
+  counter(async::threadpool &pool, int expected)
+      : async::actor<int>(pool), busy(false), sum(0), count(0),
+        expected(expected) {}
+  void receive(int &msg) override {
+    overlapped = overlapped || busy.exchange(true);
+    sum += msg;
+    if (++count == expected)
+      done.set_value();
+    busy = false;
+  }
+  std::atomic<bool> busy;
+  bool overlapped = false;
+  int64_t sum;
+  int count, expected;
+  std::promise<void> done;
+};
+
+struct recorder : public async::actor<std::string> {
+  recorder(async::threadpool &pool, std::vector<std::string> &log,
+           std::promise<void> &done, int expected)
+      : async::actor<std::string>(pool), log(log), done(done),
+        expected(expected) {}
+  void receive(std::string &msg) override {
+    log.push_back(msg); // single worker, no lock needed
+    if (static_cast<int>(log.size()) == expected)
+      done.set_value();
+  }
+  std::vector<std::string> &log;
+  std::promise<void> &done;
+  int expected;
+};
+} // namespace
+
+TEST_CASE("actor is small") {
+  CHECK(sizeof(async::actor<int>) < 100);
+  CHECK(sizeof(async::actor<std::string>) < 100);
+}
+
+TEST_CASE("actor handles messages from many threads one at a time") {
+  async::threadpool tp(4);
+  counter c(tp, 40000);
+  std::vector<std::thread> senders;
+  for (int t = 0; t < 4; ++t)
+    senders.emplace_back([&c]() {
+      for (int i = 1; i <= 10000; ++i)
+        c.send(i);
+    });
+  for (auto &t : senders)
+    t.join();
+  c.done.get_future().get();
+  CHECK(c.sum == 4 * 10000LL * 10001 / 2);
+  CHECK(!c.overlapped);
+  c.close();
+  CHECK(c.backlog() == 0);
+}
+
+TEST_CASE("actor yields the worker after its quota") {
+  async::threadpool tp(1);
+  std::atomic<bool> started(false), release(false);
+  auto blocker = tp.post([&]() {
+    started = true;
+    for (; !release;)
+      std::this_thread::yield();
+  });
+  for (; !started;)
+    std::this_thread::yield();
+  std::vector<std::string> log;
+  std::promise<void> done;
+  recorder busy(tp, log, done, 201), quiet(tp, log, done, 201);
+  for (int i = 0; i < 200; ++i)
+    busy.send("busy");
+  quiet.send("quiet");
+  release = true;
+  blocker.get();
+  done.get_future().get();
+  auto pos = std::find(log.begin(), log.end(), "quiet") - log.begin();
+  CHECK(pos == static_cast<int>(async::actor_traits::Quota));
+  busy.close();
+  quiet.close();
+}
+
+TEST_CASE("actor can be destroyed once closed") {
+  async::threadpool tp(2);
+  for (int round = 0; round < 200; ++round) {
+    std::unique_ptr<counter> c(new counter(tp, 1000));
+    std::thread sender([&]() {
+      for (int i = 1; i <= 1000; ++i)
+        c->send(i);
+    });
+    sender.join();
+    c->close(); // the last drain may still be running, close waits for it
+    CHECK(c->backlog() == 0);
+    CHECK(c->count == 1000);
+    c.reset();
+  }
+  counter idle(tp, 0);
+  idle.close(); // nothing sent
+}
@@ -0,0 +1,68 @@
+/////////////////////////////////////////////////////////////////////
+//          Copyright Yibo Zhu 2017
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+/////////////////////////////////////////////////////////////////////
+#include "allocator.h"
+#include "bounded_queue.h"
+#include "catch.hpp"
+#include "queue.h"
+#include <cstring>
+
+TEST_CASE("allocator: default allocator") {
+  auto page = async::vmem::page_size();
+  auto small = async::default_allocator::allocate(100, 8);
+  std::memset(small, 1, 100);
+  async::default_allocator::deallocate(small, 100, 8);
+  auto large = async::default_allocator::allocate(3 * page, 8);
+  CHECK(reinterpret_cast<uintptr_t>(large) % page == 0);
+  std::memset(large, 1, 3 * page);
+  async::default_allocator::deallocate(large, 3 * page, 8);
+}
+
+TEST_CASE("allocator: huge page allocator") {
+  auto huge = async::vmem::huge_page_size();
+  auto large = async::hugepage_allocator::allocate(huge + 1, 64);
+  CHECK(reinterpret_cast<uintptr_t>(large) % huge == 0);
+  std::memset(large, 1, huge + 1);
+  async::hugepage_allocator::deallocate(large, huge + 1, 64);
+
+  auto a = async::hugepage_allocator::allocate(4096, 64);
+  auto b = async::hugepage_allocator::allocate(4096, 64);
+  CHECK(a != b);
+  CHECK(reinterpret_cast<uintptr_t>(a) % 64 == 0);
+  std::memset(a, 1, 4096);
+  std::memset(b, 2, 4096);
+  async::hugepage_allocator::deallocate(a, 4096, 64);
+  auto c = async::hugepage_allocator::allocate(4096, 64);
+  CHECK(c == a); // reused from the free list
+  async::hugepage_allocator::deallocate(b, 4096, 64);
+  async::hugepage_allocator::deallocate(c, 4096, 64);
+}
+
+struct hugepage_trait : public async::traits {
+  using allocator = async::hugepage_allocator;
+};
+
+struct hugepage_bounded_trait : public async::bounded_traits {
+  using allocator = async::locked_hugepage_allocator;
+};
+
+TEST_CASE("allocator: queues on huge pages") {
+  async::queue<int, hugepage_trait> q;
+  async::bounded_queue<int, hugepage_bounded_trait> bq(1 << 20);
+  int v(0);
+  for (int i = 0; i < 10000; ++i) {
+    q.enqueue(i);
+    bq.enqueue(i);
+  }
+  for (int i = 0; i < 10000; ++i) {
+    CHECK(q.dequeue(v));
+    CHECK(v == i);
+    CHECK(bq.dequeue(v));
+    CHECK(v == i);
+  }
+  CHECK(q.dequeue(v) == false);
+  CHECK(bq.dequeue(v) == false);
+}
@@ -7,10 +7,20 @@
 #include "bounded_queue.h"
 #include "catch.hpp"
 #include <cassert>
+#include <cstring>
 #include <iostream>
 #include <iterator>
 #include <set>
+#include <string>
 #include <thread>
+#include <type_traits>
+#include <vector>
+namespace async { // classes, so they can be declared ahead
+template <typename T, typename TRAITS> class bounded_queue;
+template <typename T, size_t Capacity, typename TRAITS>
+class static_bounded_queue;
+} // namespace async
+
 struct safe_trait : public async::bounded_traits {
   static constexpr bool NOEXCEPT_CHECK = true;
 };
@@ -217,3 +227,418 @@ TEST_CASE("bounded_queue: multi-thread test") {
   }
   CHECK(sum == iteration * (iteration - 1) / 2);
 }
+
+struct waitable_bounded_trait : public async::bounded_traits {
+  static constexpr bool Waitable = true;
+};
+
+TEST_CASE("bounded_queue: wait and close") {
+  async::bounded_queue<int, waitable_bounded_trait> q(16);
+  int v(0);
+  CHECK(q.wait_dequeue_for(v, std::chrono::milliseconds(10)) ==
+        async::wait_status::timeout);
+  for (int i = 0; i < 16; ++i)
+    CHECK(q.wait_enqueue_for(std::chrono::milliseconds(10), i) ==
+          async::wait_status::ready);
+  CHECK(q.wait_enqueue_for(std::chrono::milliseconds(10), 16) ==
+        async::wait_status::timeout);
+
+  int const iteration = 10000;
+  std::atomic<int> sum(0);
+  std::vector<std::thread> consumers;
+  for (int t = 0; t < 3; ++t)
+    consumers.emplace_back([&]() {
+      int data(0), tsum(0);
+      while (q.wait_dequeue(data))
+        tsum += data;
+      sum += tsum;
+    });
+  std::thread producer([&]() {
+    for (int i = 16; i < iteration; ++i)
+      CHECK(q.wait_enqueue_for(std::chrono::seconds(10), i) ==
+            async::wait_status::ready);
+  });
+  producer.join();
+  q.close();
+  for (auto &c : consumers)
+    c.join();
+  CHECK(sum == iteration * (iteration - 1) / 2);
+  CHECK(q.closed());
+  CHECK(q.wait_dequeue_for(v, std::chrono::seconds(1)) ==
+        async::wait_status::closed);
+  CHECK(q.wait_enqueue_for(std::chrono::seconds(1), 0) ==
+        async::wait_status::closed);
+}
+
+struct packet {
+  int len;
+  char data[1024];
+};
+
+TEST_CASE("bounded_queue: zero-copy claim and consume") {
+  async::bounded_queue<packet> q(4);
+  CHECK(!q.try_consume());
+  packet *written(nullptr);
+  {
+    auto slot = q.try_claim();
+    REQUIRE(slot);
+    slot->len = 3;
+    std::memcpy(slot->data, "abc", 3);
+    written = &*slot;
+    slot.publish();
+  }
+  {
+    auto slot = q.try_claim(); // published when destroyed
+    slot->len = 0;
+  }
+  for (int i = 0; i < 2; ++i)
+    CHECK(q.try_claim());
+  CHECK(!q.try_claim()); // full
+  auto v = q.try_consume();
+  REQUIRE(v);
+  CHECK(&*v == written); // in place, no copy
+  CHECK(v->len == 3);
+  CHECK(std::memcmp(v->data, "abc", 3) == 0);
+  CHECK(!q.try_claim()); // not released yet
+  v.release();
+  CHECK(q.try_claim());
+
+  async::bounded_queue<std::string> sq(8);
+  sq.try_claim("hello").publish();
+  auto s = sq.try_consume();
+  CHECK(*s == "hello");
+}
+
+TEST_CASE("bounded_queue: zero-copy multiple threads") {
+  async::bounded_queue<int> q(64);
+  int const iteration = 20000;
+  std::atomic<int> sum(0), consumed(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 2; ++t) {
+    threads.emplace_back([&, t]() {
+      for (int i = t; i < iteration; i += 2) {
+        async::bounded_queue<int>::write_slot slot;
+        while (!(slot = q.try_claim()))
+          std::this_thread::yield();
+        *slot = i;
+      }
+    });
+    threads.emplace_back([&]() {
+      int tsum(0);
+      while (consumed.load() < iteration) {
+        auto v = q.try_consume();
+        if (v) {
+          tsum += *v;
+          ++consumed;
+        }
+      }
+      sum += tsum;
+    });
+  }
+  for (auto &t : threads)
+    t.join();
+  CHECK(sum == iteration * (iteration - 1) / 2);
+}
+
+TEST_CASE("bounded_queue: bulk enqueue/dequeue") {
+  async::bounded_queue<int> q(6); // not a power of 2
+  std::vector<int> in{0, 1, 2, 3, 4, 5, 6, 7}, out;
+  CHECK(q.try_enqueue_bulk(in.begin(), 4) == 4);
+  CHECK(q.try_enqueue_bulk(in.begin() + 4, 4) == 2); // full
+  CHECK(q.try_enqueue_bulk(in.begin(), 1) == 0);
+  CHECK(q.try_dequeue_bulk(std::back_inserter(out), 3) == 3);
+  CHECK(q.try_enqueue_bulk(in.begin() + 6, 2) == 2);
+  CHECK(q.try_dequeue_bulk(std::back_inserter(out), 10) == 5);
+  CHECK(q.try_dequeue_bulk(std::back_inserter(out), 10) == 0);
+  CHECK(out == std::vector<int>({0, 1, 2, 3, 4, 5, 6, 7}));
+}
+
+TEST_CASE("bounded_queue: bulk with throw constructor") {
+  async::bounded_queue<ThrowStruct_B, safe_trait> q(8);
+  std::vector<int> in{1, 2, 3};
+  CHECK(q.try_enqueue_bulk(in.begin(), 3) == 3);
+  ThrowStruct_B out[8];
+  CHECK(q.try_dequeue_bulk(std::begin(out), 8) == 2); // 2 skipped
+  CHECK(q.try_dequeue_bulk(std::begin(out), 8) == 0);
+}
+
+TEST_CASE("bounded_queue: bulk multiple threads") {
+  async::bounded_queue<int> q(256);
+  int const iteration = 40000;
+  std::atomic<int> sum(0), consumed(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 2; ++t) {
+    threads.emplace_back([&, t]() {
+      int batch[16];
+      for (int i = t * iteration / 2; i < (t + 1) * iteration / 2;) {
+        int n = std::min(16, (t + 1) * iteration / 2 - i);
+        for (int k = 0; k < n; ++k)
+          batch[k] = i + k;
+        size_t done(0);
+        while (done < static_cast<size_t>(n))
+          done += q.try_enqueue_bulk(batch + done, n - done);
+        i += n;
+      }
+    });
+    threads.emplace_back([&]() {
+      int batch[16], tsum(0);
+      while (consumed.load() < iteration) {
+        auto n = q.try_dequeue_bulk(std::begin(batch), 16);
+        for (size_t k = 0; k < n; ++k)
+          tsum += batch[k];
+        consumed += static_cast<int>(n);
+      }
+      sum += tsum;
+    });
+  }
+  for (auto &t : threads)
+    t.join();
+  CHECK(sum == static_cast<int>(static_cast<int64_t>(iteration) *
+                                (iteration - 1) / 2));
+}
+
+TEST_CASE("bounded_queue: static capacity") {
+  async::static_bounded_queue<int, 8> q8;
+  async::static_bounded_queue<int, 6> q6;
+  CHECK(q8.size() == 8);
+  CHECK(q6.size() == 6);
+  int v(0);
+  for (int round = 0; round < 5; ++round) { // wrap around a few times
+    for (int i = 0; i < 8; ++i)
+      CHECK(q8.enqueue(i));
+    CHECK(!q8.enqueue(8));
+    for (int i = 0; i < 6; ++i)
+      CHECK(q6.enqueue(i));
+    CHECK(!q6.enqueue(6));
+    for (int i = 0; i < 8; ++i) {
+      CHECK(q8.dequeue(v));
+      CHECK(v == i);
+    }
+    CHECK(!q8.dequeue(v));
+    for (int i = 0; i < 6; ++i) {
+      CHECK(q6.dequeue(v));
+      CHECK(v == i);
+    }
+    CHECK(!q6.dequeue(v));
+  }
+  async::static_bounded_queue<std::string, 3> sq;
+  sq.enqueue("left in the queue");
+  sq.enqueue("and destroyed with it");
+  static_assert(
+      !std::is_constructible<async::static_bounded_queue<int, 8>, size_t>::value,
+      "the capacity is given by the type");
+  static_assert(
+      std::is_constructible<async::bounded_queue<int>, size_t>::value &&
+          !std::is_convertible<size_t, async::bounded_queue<int>>::value,
+      "explicit size constructor");
+}
+
+struct padded_bounded_trait : public async::bounded_traits {
+  static constexpr async::slot_layout SlotLayout = async::slot_layout::padded;
+};
+
+struct spread_bounded_trait : public async::bounded_traits {
+  static constexpr async::slot_layout SlotLayout = async::slot_layout::spread;
+};
+
+template <typename Q> void fill_and_drain(Q &q, size_t size) {
+  int v(0);
+  for (int round = 0; round < 3; ++round) {
+    for (size_t i = 0; i < size; ++i)
+      CHECK(q.enqueue(static_cast<int>(i)));
+    CHECK(!q.enqueue(0));
+    for (size_t i = 0; i < size; ++i) {
+      CHECK(q.dequeue(v));
+      CHECK(v == static_cast<int>(i));
+    }
+    CHECK(!q.dequeue(v));
+  }
+}
+
+TEST_CASE("bounded_queue: slot layouts") {
+  for (size_t size : {1, 3, 4, 8, 12, 64, 100, 1024}) {
+    async::bounded_queue<int, padded_bounded_trait> padded(size);
+    fill_and_drain(padded, size);
+    async::bounded_queue<int, spread_bounded_trait> spread(size);
+    fill_and_drain(spread, size);
+  }
+  async::static_bounded_queue<int, 64, spread_bounded_trait> s64;
+  fill_and_drain(s64, 64);
+  async::static_bounded_queue<int, 12, spread_bounded_trait> s12;
+  fill_and_drain(s12, 12);
+  async::static_bounded_queue<int, 10, spread_bounded_trait> s10;
+  fill_and_drain(s10, 10);
+  int data[64];
+  for (int i = 0; i < 64; ++i)
+    data[i] = i;
+  async::bounded_queue<int, spread_bounded_trait> bulk(64);
+  CHECK(bulk.try_enqueue_bulk(data, 64) == 64);
+  int out[64];
+  CHECK(bulk.try_dequeue_bulk(std::begin(out), 64) == 64);
+  for (int i = 0; i < 64; ++i)
+    CHECK(out[i] == i);
+}
+
+// cache line of the slot of each ticket, in ticket order
+template <typename Q>
+static std::vector<uintptr_t> ticketlines(Q &q, size_t size) {
+  std::vector<uintptr_t> lines;
+  for (size_t k = 0; k < size; ++k) {
+    auto slot = q.try_claim(0);
+    lines.push_back(reinterpret_cast<uintptr_t>(&*slot) / 64);
+  }
+  int v(0);
+  while (q.dequeue(v))
+    ;
+  return lines;
+}
+
+// tickets less than apart are on different lines, the others share lines
+static void checkspread(std::vector<uintptr_t> const &lines, size_t apart) {
+  for (size_t k = 0; k < lines.size(); ++k)
+    for (size_t j = k + 1; j < lines.size(); ++j)
+      CHECK((lines[k] == lines[j]) == ((j - k) % apart == 0));
+}
+
+TEST_CASE("bounded_queue: spread slot addresses") {
+  // int slots are 16 bytes, 4 per cache line
+  async::bounded_queue<int, spread_bounded_trait> q(64);
+  checkspread(ticketlines(q, 64), 16);
+  checkspread(ticketlines(q, 64), 16); // next round, same slots
+  async::static_bounded_queue<int, 64, spread_bounded_trait> s64;
+  checkspread(ticketlines(s64, 64), 16);
+  // 2 lines only, neighbours would share them, packed instead
+  async::bounded_queue<int, spread_bounded_trait> small(8);
+  auto lines = ticketlines(small, 8);
+  for (size_t k = 1; k < lines.size(); ++k)
+    CHECK(lines[k] >= lines[k - 1]);
+}
+
+struct overwrite_bounded_trait : public async::bounded_traits {
+  static constexpr bool Overwrite = true;
+};
+
+TEST_CASE("bounded_queue: overwrite oldest") {
+  async::bounded_queue<std::string, overwrite_bounded_trait> q(4);
+  std::string s;
+  CHECK(!q.dequeue(s));
+  for (int i = 0; i < 10; ++i)
+    CHECK(q.enqueue(std::to_string(i)));
+  CHECK(q.dropped() == 6);
+  for (int i = 6; i < 10; ++i) {
+    CHECK(q.dequeue(s));
+    CHECK(s == std::to_string(i));
+  }
+  CHECK(!q.dequeue(s));
+  q.blocking_enqueue("10");
+  CHECK(q.dequeue(s));
+  CHECK(s == "10");
+  for (int i = 0; i < 6; ++i) // left in the ring, destroyed with it
+    q.enqueue(std::to_string(i));
+  CHECK(q.dropped() == 8);
+
+  async::static_bounded_queue<int, 3, overwrite_bounded_trait> sq;
+  for (int i = 0; i < 7; ++i)
+    sq.enqueue(i);
+  int v(0);
+  for (int i = 4; i < 7; ++i) {
+    CHECK(sq.dequeue(v));
+    CHECK(v == i);
+  }
+  CHECK(!sq.dequeue(v));
+  CHECK(sq.dropped() == 4);
+}
+
+TEST_CASE("bounded_queue: overwrite multiple threads") {
+  int const iteration = 100000, producers = 3;
+  async::bounded_queue<std::pair<int, int>, overwrite_bounded_trait> q(64);
+  std::atomic<bool> done(false);
+  std::atomic<int> received(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 2; ++t)
+    threads.emplace_back([&]() {
+      std::pair<int, int> data;
+      std::vector<int> last(producers, -1);
+      int n(0);
+      for (;;) {
+        bool stop = done.load();
+        if (!q.dequeue(data)) {
+          if (stop)
+            break;
+          continue;
+        }
+        CHECK(data.second > last[data.first]); // no duplicate, in order
+        last[data.first] = data.second;
+        ++n;
+      }
+      received += n;
+    });
+  std::vector<std::thread> producerthreads;
+  for (int p = 0; p < producers; ++p)
+    producerthreads.emplace_back([&, p]() {
+      for (int i = 0; i < iteration; ++i)
+        CHECK(q.enqueue(p, i));
+    });
+  for (auto &t : producerthreads)
+    t.join();
+  done = true;
+  for (auto &t : threads)
+    t.join();
+  CHECK(received + q.dropped() == iteration * producers);
+}
+
+struct stamp { // trivially copyable, so copied out and validated (seqlock)
+  int producer;
+  int seq;
+  int check[14]; // check[i] == seq * (i + 1), a torn copy breaks it
+};
+
+TEST_CASE("bounded_queue: overwrite trivially copyable elements") {
+  int const iteration = 100000, producers = 3;
+  async::bounded_queue<stamp, overwrite_bounded_trait> q(16);
+  std::atomic<bool> done(false), torn(false), outoforder(false);
+  std::atomic<int> received(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 2; ++t)
+    threads.emplace_back([&]() {
+      stamp data;
+      std::vector<int> last(producers, -1);
+      int n(0);
+      for (;;) {
+        bool stop = done.load();
+        if (!q.dequeue(data)) {
+          if (stop)
+            break;
+          continue;
+        }
+        for (int i = 0; i < 14; ++i)
+          if (data.check[i] != data.seq * (i + 1))
+            torn = true;
+        if (data.seq <= last[data.producer])
+          outoforder = true; // or taken twice
+        last[data.producer] = data.seq;
+        ++n;
+      }
+      received += n;
+    });
+  std::vector<std::thread> producerthreads;
+  for (int p = 0; p < producers; ++p)
+    producerthreads.emplace_back([&, p]() {
+      stamp data;
+      data.producer = p;
+      for (int i = 0; i < iteration; ++i) {
+        data.seq = i;
+        for (int k = 0; k < 14; ++k)
+          data.check[k] = i * (k + 1);
+        q.enqueue(data);
+      }
+    });
+  for (auto &t : producerthreads)
+    t.join();
+  done = true;
+  for (auto &t : threads)
+    t.join();
+  CHECK(!torn);
+  CHECK(!outoforder);
+  CHECK(received + q.dropped() == iteration * producers);
+}
@@ -0,0 +1,72 @@
+/////////////////////////////////////////////////////////////////////
+//          Copyright Yibo Zhu 2017
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+/////////////////////////////////////////////////////////////////////
+#include "eventcount.h"
+#include "catch.hpp"
+#include <atomic>
+#include <thread>
+#include <vector>
+
+TEST_CASE("eventcount: wait and notify") {
+  async::eventcount ec;
+  std::atomic<int> flag(0);
+  auto key = ec.prepare_wait();
+  CHECK(ec.wait_until(key, std::chrono::steady_clock::now() +
+                               std::chrono::milliseconds(5)) == false);
+  ec.notify_all(); // nobody waits
+
+  std::vector<std::thread> waiters;
+  std::atomic<int> woken(0);
+  for (int i = 0; i < 4; ++i)
+    waiters.emplace_back([&]() {
+      for (;;) {
+        auto k = ec.prepare_wait();
+        if (flag.load() != 0) {
+          ec.cancel_wait();
+          break;
+        }
+        ec.wait(k);
+      }
+      ++woken;
+    });
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  flag.store(1);
+  ec.notify_all();
+  for (auto &w : waiters)
+    w.join();
+  CHECK(woken == 4);
+}
+
+TEST_CASE("eventcount: await") {
+  async::eventcount ec;
+  std::atomic<int> items(0);
+  std::atomic<bool> closed(false);
+  auto take = [&]() {
+    auto n = items.load();
+    while (n > 0)
+      if (items.compare_exchange_weak(n, n - 1))
+        return true;
+    return false;
+  };
+  auto isclosed = [&]() { return closed.load(); };
+  CHECK(ec.await_until(take, isclosed,
+                       std::chrono::steady_clock::now() +
+                           std::chrono::milliseconds(5)) ==
+        async::wait_status::timeout);
+  std::atomic<int> taken(0);
+  std::thread consumer([&]() {
+    while (ec.await(take, isclosed) == async::wait_status::ready)
+      ++taken;
+  });
+  for (int i = 0; i < 1000; ++i) {
+    ++items;
+    ec.notify_one();
+  }
+  closed = true;
+  ec.notify_all();
+  consumer.join();
+  CHECK(taken == 1000);
+}
@@ -0,0 +1,71 @@
+/////////////////////////////////////////////////////////////////////
+//          Copyright Yibo Zhu 2017
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+/////////////////////////////////////////////////////////////////////
+#include "hazard.h"
+#include "catch.hpp"
+#include <atomic>
+#include <thread>
+
+TEST_CASE("hazard: protect and publish") {
+  int a(1), b(2);
+  std::atomic<int *> shared(&a);
+  CHECK(!async::hazard::published(&a));
+  {
+    async::hazard::guard<int> g;
+    CHECK(g.protect(shared) == &a);
+    CHECK(async::hazard::published(&a));
+    {
+      async::hazard::guard<int> nested;
+      shared = &b;
+      CHECK(nested.protect(shared) == &b);
+      CHECK(async::hazard::published(&a));
+      CHECK(async::hazard::published(&b));
+    }
+    CHECK(!async::hazard::published(&b));
+    g.reset();
+    CHECK(!async::hazard::published(&a));
+  }
+}
+
+TEST_CASE("hazard: sticky guards stay published") {
+  int a(1), b(2);
+  std::atomic<int *> shared(&a);
+  {
+    async::hazard::sticky_guard<int> g;
+    CHECK(g.protect(shared) == &a);
+  }
+  CHECK(async::hazard::published(&a)); // until the next protect
+  {
+    async::hazard::sticky_guard<int> g;
+    CHECK(g.protect(shared) == &a);
+    shared = &b;
+    CHECK(g.protect(shared) == &b);
+    CHECK(!async::hazard::published(&a));
+    CHECK(async::hazard::published(&b));
+    g.reset();
+  }
+  CHECK(!async::hazard::published(&b));
+  std::thread t([&]() {
+    async::hazard::sticky_guard<int> g;
+    g.protect(shared);
+  });
+  t.join();
+  CHECK(!async::hazard::published(&b)); // released on thread exit
+}
+
+TEST_CASE("hazard: records are reused") {
+  int a(1);
+  std::atomic<int *> shared(&a);
+  for (int i = 0; i < 4; ++i) {
+    std::thread t([&]() {
+      async::hazard::guard<int> g;
+      g.protect(shared);
+      CHECK(async::hazard::published(&a));
+    });
+    t.join();
+    CHECK(!async::hazard::published(&a)); // released on thread exit
+  }
+}
@@ -0,0 +1,181 @@
+/////////////////////////////////////////////////////////////////////
+//          Copyright Yibo Zhu 2017
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+/////////////////////////////////////////////////////////////////////
+#include "numa.h"
+#include "bounded_queue.h"
+#include "catch.hpp"
+#include "queue.h"
+#include "resizable_bounded_queue.h"
+#include <cstring>
+#include <memory>
+#include <thread>
+
+TEST_CASE("numa: topology") {
+  CHECK(async::numa::node_count() >= 1);
+  auto node = async::numa::current_node();
+  CHECK(node >= 0);
+  CHECK(static_cast<size_t>(node) < async::numa::node_count());
+}
+
+TEST_CASE("numa: place on this box") {
+  auto bytes = async::vmem::page_size() * 4;
+  auto ptr = async::vmem::allocate(bytes);
+  async::numa::place(ptr, bytes, async::numa::placement::interleave());
+  std::memset(ptr, 1, bytes); // fault the pages in
+  auto node = async::numa::node_of_address(ptr);
+  CHECK(node >= -1);
+  CHECK(node < static_cast<int>(async::numa::node_count()));
+  async::vmem::deallocate(ptr, bytes);
+  CHECK(async::numa::place(ptr, bytes, async::numa::placement::bind(-1)) ==
+        false);
+}
+
+TEST_CASE("numa: simulated placement") {
+  async::numa::simulate(4);
+  CHECK(async::numa::node_count() == 4);
+  CHECK(async::numa::node_of_cpu(6) == 2);
+  using allocator = async::numa_allocator<>;
+  auto page = async::vmem::page_size();
+
+  async::numa::simulate_node(3);
+  allocator local;
+  CHECK(local.placement().policy == async::numa::placement::LOCAL);
+  auto ptr = local.allocate(page * 2, 8);
+  CHECK(async::numa::node_of_address(ptr) == 3);
+  {
+    allocator bound(async::numa::placement::bind(1));
+    auto p = bound.allocate(page, 8);
+    CHECK(async::numa::node_of_address(p) == 1);
+    bound.deallocate(p, page, 8);
+    CHECK(async::numa::node_of_address(p) == -1);
+    allocator preferred(async::numa::placement::preferred(2));
+    p = preferred.allocate(page, 8);
+    CHECK(async::numa::node_of_address(p) == 2);
+    preferred.deallocate(p, page, 8);
+  }
+  {
+    async::numa::scope s(async::numa::placement::interleave());
+    allocator interleaved; // takes the placement of the scope
+    auto spread = static_cast<char *>(interleaved.allocate(page * 8, 8));
+    for (size_t i = 0; i < 8; ++i)
+      CHECK(async::numa::node_of_address(spread + i * page) ==
+            static_cast<int>(i % 4));
+    interleaved.deallocate(spread, page * 8, 8);
+  }
+  auto small = local.allocate(64, 8); // shares its page, left alone
+  CHECK(async::numa::node_of_address(small) == -1);
+  local.deallocate(small, 64, 8);
+  local.deallocate(ptr, page * 2, 8);
+
+  std::thread consumer([]() {});
+  auto node = async::numa::node_of(consumer);
+  CHECK(node >= 0);
+  CHECK(node < 4);
+  consumer.join();
+  async::numa::simulate_node(0);
+  async::numa::simulate(0);
+}
+
+struct numa_trait : public async::traits {
+  using allocator = async::numa_allocator<>;
+};
+
+struct numa_ahead_trait : public numa_trait {
+  static constexpr size_t AllocAhead = 2;
+};
+
+struct numa_bounded_trait : public async::bounded_traits {
+  using allocator = async::numa_allocator<>;
+};
+
+// records where the queue constructed it, i.e. the node's storage
+struct located {
+  located() {}
+  explicit located(void const **where) { *where = this; }
+};
+
+// the node of the storage of n elements enqueued into q, -1 if they differ
+template <typename Q> static int nodeof(Q &q, int n) {
+  int node(-2);
+  for (int i = 0; i < n; ++i) {
+    void const *where(nullptr);
+    q.enqueue(&where);
+    auto cur = async::numa::node_of_address(where);
+    node = node == -2 || node == cur ? cur : -1;
+  }
+  return node;
+}
+
+TEST_CASE("numa: queues with numa placement") {
+  async::numa::simulate(2);
+  async::numa::simulate_node(1);
+  async::queue<int, numa_trait> q;
+  async::numa::scope s(async::numa::placement::interleave());
+  async::bounded_queue<int, numa_bounded_trait> bq(1 << 12);
+  std::thread producer([&]() {
+    async::numa::simulate_node(0);
+    for (int i = 0; i < 10000; ++i)
+      q.enqueue(i);
+  });
+  producer.join();
+  int v(0);
+  for (int i = 0; i < 10000; ++i) {
+    CHECK(q.dequeue(v));
+    CHECK(v == i);
+  }
+  for (int i = 0; i < 100; ++i)
+    bq.enqueue(i);
+  for (int i = 0; i < 100; ++i) {
+    CHECK(bq.dequeue(v));
+    CHECK(v == i);
+  }
+  async::numa::simulate_node(0);
+  async::numa::simulate(0);
+}
+
+TEST_CASE("numa: the placement is kept by the queue") {
+  async::numa::simulate(2);
+  using allocator = async::numa_allocator<>;
+  int const groupsize = 1 << async::traits::Basebits;
+
+  // bound at construction, the groups allocated later by a producer on the
+  // other node follow it
+  async::queue<located, numa_trait> bound(
+      0, allocator(async::numa::placement::bind(1)));
+  std::unique_ptr<async::numa::scope> sc(
+      new async::numa::scope(async::numa::placement::bind(1)));
+  async::queue<located, numa_trait> scoped; // on the stack, over-aligned
+  sc.reset();
+  async::numa::simulate_node(1);
+  async::queue<located, numa_trait> local; // its first group on node 1
+  std::thread producer([&]() {
+    async::numa::simulate_node(0);
+    CHECK(nodeof(bound, groupsize * 4) == 1);
+    CHECK(nodeof(scoped, groupsize * 4) == 1);
+    nodeof(local, groupsize);
+    CHECK(nodeof(local, groupsize * 3) == 0); // the allocating thread's
+  });
+  producer.join();
+  async::numa::simulate_node(0);
+
+  // the groups allocated ahead by replenish() too
+  async::queue<located, numa_ahead_trait> ahead(
+      0, allocator(async::numa::placement::bind(1)));
+  located x;
+  CHECK(!ahead.dequeue(x)); // replenishes
+  CHECK(ahead.replenish() == 0);
+  CHECK(nodeof(ahead, groupsize * 3) == 1);
+
+  // the ring of a bounded_queue, and the rings of a resized one
+  async::bounded_queue<located, numa_bounded_trait> bq(
+      groupsize * 4, allocator(async::numa::placement::bind(1)));
+  CHECK(nodeof(bq, groupsize * 4) == 1);
+  async::resizable_bounded_queue<located, numa_bounded_trait> rq(
+      groupsize, allocator(async::numa::placement::bind(1)));
+  rq.resize(groupsize * 4);
+  CHECK(nodeof(rq, groupsize * 4) == 1);
+  async::numa::simulate(0);
+}
@@ -0,0 +1,88 @@
+/////////////////////////////////////////////////////////////////////
+//          Copyright Yibo Zhu 2017
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+/////////////////////////////////////////////////////////////////////
+#include "catch.hpp"
+#include "percore_runtime.h"
+#include <algorithm>
+#include <vector>
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+TEST_CASE("percore_runtime submit_to runs on the given core") {
+  async::percore_runtime rt(4);
+  CHECK(rt.size() == 4);
+  size_t const npos = async::percore_runtime::npos;
+  CHECK(rt.current_core() == npos);
+  std::vector<std::future<size_t>> rels;
+  for (size_t i = 0; i < 100; ++i)
+    rels.push_back(rt.submit_to(i % 4, [&rt]() { return rt.current_core(); }));
+  for (size_t i = 0; i < 100; ++i)
+    CHECK(rels[i].get() == i % 4);
+  CHECK(rt.submit_to(1, [](int i, int j) { return i + j; }, 1, 2).get() == 3);
+  CHECK_THROWS_AS(rt.submit_to(4, []() {}), std::out_of_range const &);
+}
+
+TEST_CASE("percore_runtime workers are pinned to the allowed cpus") {
+  auto cpus = allowed_cpus();
+  REQUIRE(!cpus.empty());
+  CHECK(std::is_sorted(cpus.begin(), cpus.end()));
+  async::percore_runtime rt(cpus.size() + 1); // one more than allowed
+  for (size_t i = 0; i < rt.size(); ++i) {
+    auto cpu = rt.cpu_of(i);
+    if (cpu == async::percore_runtime::npos)
+      continue; // not supported, or not allowed
+    CHECK(cpu == cpus[i % cpus.size()]);
+#if defined(__linux__)
+    CHECK(rt.submit_to(i, []() { return sched_getcpu(); }).get() ==
+          static_cast<int>(cpu));
+#endif
+  }
+  CHECK_THROWS_AS(rt.cpu_of(rt.size()), std::out_of_range const &);
+}
+
+TEST_CASE("percore_runtime cross-core messages keep their order") {
+  async::percore_runtime rt(2, 8); // small rings to exercise the overflow
+  std::vector<int> received; // only touched by core 1
+  auto sender = rt.submit_to(0, [&]() {
+    std::vector<std::future<void>> rels;
+    for (int i = 0; i < 1000; ++i)
+      rels.push_back(rt.submit_to(1, [&, i]() { received.push_back(i); }));
+    return rels;
+  });
+  for (auto &rel : sender.get())
+    rel.get();
+  REQUIRE(received.size() == 1000);
+  bool inorder(true);
+  for (int i = 0; i < 1000; ++i)
+    inorder = inorder && received[i] == i;
+  CHECK(inorder);
+}
+
+TEST_CASE("percore_runtime local tasks and ping-pong") {
+  async::percore_runtime rt(3);
+  std::promise<int> done;
+  std::function<void(int)> hop = [&](int left) {
+    if (left == 0) {
+      done.set_value(static_cast<int>(rt.current_core()));
+      return;
+    }
+    rt.submit_to((rt.current_core() + 1) % 3, hop, left - 1);
+  };
+  rt.submit_to(0, hop, 299);
+  CHECK(done.get_future().get() == 299 % 3);
+
+  std::promise<size_t> localdone;
+  rt.submit_to(2, [&]() {
+    auto count = std::make_shared<int>(0);
+    for (int i = 0; i < 10; ++i)
+      rt.submit_to(2, [&, count]() { // queued on the local run queue
+        if (++*count == 10)
+          localdone.set_value(rt.current_core());
+      });
+  });
+  CHECK(localdone.get_future().get() == 2);
+}
@@ -6,11 +6,20 @@
 /////////////////////////////////////////////////////////////////////
 #include "catch.hpp"
 #include "queue.h"
+#include <algorithm>
 #include <cassert>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <iterator>
 #include <set>
+#include <string>
 #include <thread>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#endif
 struct safe_trait : public async::traits {
   static constexpr bool NOEXCEPT_CHECK = true;
 };
@@ -110,6 +119,424 @@ TEST_CASE("queue: SAFE_IMPL true with no throw constructor ") {
   CHECK(q.dequeue(t) == false); // empty now
 }
 
+struct nomagazine_trait : public async::traits {
+  static constexpr size_t MagazineSize = 0;
+};
+
+TEST_CASE("queue: free nodes are reused through the magazine") {
+  async::queue<int> q;
+  int v(0);
+  for (int i = 0; i < 1000; ++i) {
+    q.enqueue(i);
+    q.enqueue(i);
+    q.dequeue(v);
+    q.dequeue(v);
+  }
+  CHECK(q.getNodeCount() <= 6);
+  for (int i = 0; i < 100; ++i) // overflow the magazine
+    q.enqueue(i);
+  for (int i = 0; i < 100; ++i)
+    q.dequeue(v);
+  auto count = q.getNodeCount();
+  for (int i = 0; i < 100; ++i) // refilled from the free list
+    q.enqueue(i);
+  CHECK(q.getNodeCount() == count);
+  for (int i = 0; i < 100; ++i) {
+    CHECK(q.dequeue(v));
+    CHECK(v == i);
+  }
+  CHECK(q.dequeue(v) == false);
+}
+
+struct exitflush_trait : public async::traits {}; // slots of its own
+
+TEST_CASE("queue: an exiting thread flushes its magazine") {
+  async::queue<int, exitflush_trait> q;
+  int v(0);
+  q.enqueue(0); // this thread takes a slot first
+  q.dequeue(v);
+  std::thread t([&]() {
+    int w(0);
+    for (int i = 0; i < 10; ++i)
+      q.enqueue(i);
+    for (int i = 0; i < 10; ++i)
+      q.dequeue(w); // the nodes go to this thread's magazine
+  });
+  t.join();
+  auto count = q.getNodeCount();
+  for (int i = 0; i < 10; ++i) // the flushed nodes are reused
+    q.enqueue(i);
+  CHECK(q.getNodeCount() == count);
+}
+
+TEST_CASE("queue: magazines disabled") {
+  async::queue<int, nomagazine_trait> q;
+  int v(0);
+  for (int i = 0; i < 100; ++i)
+    q.enqueue(i);
+  for (int i = 0; i < 100; ++i)
+    q.dequeue(v);
+  auto count = q.getNodeCount();
+  for (int i = 0; i < 100; ++i)
+    q.enqueue(i);
+  CHECK(q.getNodeCount() == count);
+  CHECK(q.dequeue(v));
+  CHECK(v == 0);
+}
+
+TEST_CASE("queue: shrink_to_fit after a burst") {
+  async::queue<int> q;
+  int v(0);
+  for (int i = 0; i < 10000; ++i)
+    q.enqueue(i);
+  for (int i = 0; i < 10000; ++i)
+    q.dequeue(v);
+  auto count = q.getNodeCount();
+  CHECK(q.shrink_to_fit() > 0);
+  CHECK(q.shrink_to_fit() == 0); // nothing left to trim
+  for (int i = 0; i < 10000; ++i) // trimmed nodes are reused first
+    q.enqueue(i);
+  CHECK(q.getNodeCount() == count);
+  for (int i = 0; i < 10000; ++i) {
+    CHECK(q.dequeue(v));
+    CHECK(v == i);
+  }
+  CHECK(q.dequeue(v) == false);
+}
+
+struct trim_trait : public async::traits {
+  static constexpr size_t TrimRatio = 2;
+};
+
+TEST_CASE("queue: trimmed automatically after bursts") {
+  async::queue<int, trim_trait> q;
+  int v(0);
+  for (int round = 0; round < 5; ++round) {
+    for (int i = 0; i < 10000; ++i)
+      q.enqueue(i);
+    for (int i = 0; i < 10000; ++i) {
+      CHECK(q.dequeue(v));
+      CHECK(v == i);
+    }
+    for (int i = 0; i < 10000; ++i) { // quiet period
+      q.enqueue(i);
+      q.dequeue(v);
+    }
+  }
+  CHECK(q.dequeue(v) == false);
+  CHECK(q.getNodeCount() < 2 * 10000); // bursts reuse the trimmed nodes
+  CHECK(q.shrink_to_fit() < 10000);    // most were trimmed already
+}
+
+struct flat_trait : public async::traits {
+  static constexpr uint64_t FlatBits = 24;
+};
+
+TEST_CASE("queue: flat storage") {
+  async::queue<int, flat_trait> q;
+  int v(0);
+  for (int i = 0; i < 10000; ++i)
+    q.enqueue(i);
+  for (int i = 0; i < 10000; ++i) {
+    CHECK(q.dequeue(v));
+    CHECK(v == i);
+  }
+  CHECK(q.dequeue(v) == false);
+  auto count = q.getNodeCount();
+  CHECK(q.shrink_to_fit() > 0); // committed pages can be trimmed as well
+  for (int i = 0; i < 10000; ++i)
+    q.enqueue(i);
+  CHECK(q.getNodeCount() == count);
+  int b[100];
+  CHECK(q.bulk_dequeue(&b[0], 100) == 100);
+  CHECK(b[99] == 99);
+}
+
+TEST_CASE("queue: automatic trims keep the recent peak free") {
+  async::queue<int, trim_trait> q;
+  int v(0);
+  for (int i = 0; i < 20000; ++i)
+    q.enqueue(i);
+  for (int i = 0; i < 19000; ++i)
+    q.dequeue(v);
+  for (int i = 0; i < 100000; ++i) { // 1000 in flight
+    q.enqueue(i);
+    q.dequeue(v);
+  }
+  auto count = q.getNodeCount();
+  CHECK(count < 20000 + 1000);      // the trims don't make the queue grow
+  CHECK(q.shrink_to_fit() >= 256);  // a peak's worth was kept free
+  for (int i = 0; i < 1000; ++i)
+    CHECK(q.dequeue(v));
+  CHECK(!q.dequeue(v));
+}
+
+struct small_flat_trait : public async::traits {
+  static constexpr uint64_t FlatBits = 9; // 2 basecontainers
+  static constexpr bool NOEXCEPT_CHECK = true;
+};
+
+TEST_CASE("queue: flat storage runs out") {
+  async::queue<std::string, small_flat_trait> q;
+  std::string const s("x"); // copied, may throw, so enqueue reports failures
+  int count(0);
+  while (q.enqueue(s))
+    ++count;
+  CHECK(count > 256);
+  CHECK(count < 512);
+  CHECK(!q.enqueue(s)); // still out
+  std::string v;
+  CHECK(q.dequeue(v));
+  CHECK(q.dequeue(v));
+  std::string more[4] = {"a", "b", "c", "d"};
+  q.bulk_enqueue(&more[0], 4); // the ones which fit are linked
+  for (int i = 2; i < count; ++i)
+    CHECK(q.dequeue(v));
+  int bulked(0);
+  for (; q.dequeue(v); ++bulked)
+    CHECK(v == more[bulked]);
+  CHECK(bulked >= 2);
+  CHECK(bulked < 4);
+}
+
+TEST_CASE("queue: flat storage pre-allocated") {
+  async::queue<std::string, flat_trait> q(1000);
+  auto count = q.getNodeCount();
+  for (int i = 0; i < 500; ++i)
+    q.enqueue(std::to_string(i));
+  CHECK(q.getNodeCount() == count);
+  std::string s;
+  CHECK(q.dequeue(s));
+  CHECK(s == "0");
+} // the strings left are destroyed with the queue
+
+struct allocahead_trait : public async::traits {
+  static constexpr size_t AllocAhead = 4;
+};
+
+// counts the allocations made by the calling thread
+struct threadcount_allocator {
+  static constexpr bool hugepages = false;
+  static void *allocate(size_t bytes, size_t align) {
+    ++count();
+    return async::default_allocator::allocate(bytes, align);
+  }
+  static void deallocate(void *ptr, size_t bytes, size_t align) noexcept {
+    async::default_allocator::deallocate(ptr, bytes, align);
+  }
+  static size_t &count() {
+    static thread_local size_t n = 0;
+    return n;
+  }
+};
+
+struct countahead_trait : public allocahead_trait {
+  using allocator = threadcount_allocator;
+};
+
+TEST_CASE("queue: groups allocated ahead") {
+  async::queue<int, allocahead_trait> q;
+  CHECK(q.replenish() > 0);
+  CHECK(q.replenish() == 0); // ready already
+  for (int i = 0; i < 1000; ++i)
+    q.enqueue(i);
+  int v(0);
+  for (int i = 0; i < 1000; ++i) {
+    CHECK(q.dequeue(v));
+    CHECK(v == i);
+  }
+  CHECK(q.dequeue(v) == false); // replenished by the idle consumer
+  CHECK(q.replenish() == 0);
+
+  // the producer finds the next groups allocated when it reaches their
+  // boundaries, it allocates none of them itself
+  int const groupsize = 1 << allocahead_trait::Basebits;
+  async::queue<int, countahead_trait> counted;
+  std::thread helper([&]() { CHECK(counted.replenish() > 0); });
+  helper.join();
+  auto allocated = threadcount_allocator::count();
+  for (int i = 0; i < groupsize * 4; ++i)
+    counted.enqueue(i);
+  CHECK(threadcount_allocator::count() == allocated);
+  helper = std::thread([&]() { CHECK(counted.replenish() > 0); });
+  helper.join();
+  for (int i = 0; i < groupsize * 2; ++i)
+    counted.enqueue(i);
+  CHECK(threadcount_allocator::count() == allocated);
+}
+
+struct flatahead_trait : public flat_trait {
+  static constexpr size_t AllocAhead = 4;
+};
+
+TEST_CASE("queue: flat storage allocated ahead") {
+  async::queue<int, flatahead_trait> q;
+  int v(0);
+  CHECK(q.dequeue(v) == false);
+  CHECK(q.replenish() == 0);
+  for (int i = 0; i < 2000; ++i)
+    q.enqueue(i);
+  CHECK(q.replenish() > 0);
+  for (int i = 0; i < 2000; ++i) {
+    CHECK(q.dequeue(v));
+    CHECK(v == i);
+  }
+}
+
+TEST_CASE("queue: reserve") {
+  async::queue<int> q;
+  auto count = q.getNodeCount();
+  q.reserve(100000);
+  CHECK(q.getNodeCount() == count + 100000);
+  for (int i = 0; i < 100000; ++i)
+    q.enqueue(i);
+  CHECK(q.getNodeCount() == count + 100000); // no new node
+  int v(0);
+  for (int i = 0; i < 100000; ++i) {
+    CHECK(q.dequeue(v));
+    CHECK(v == i);
+  }
+  CHECK(q.dequeue(v) == false);
+  async::queue<int, flat_trait> f(100000);
+  count = f.getNodeCount();
+  f.reserve(1);
+  for (int i = 0; i < 100000 - 256; ++i)
+    f.enqueue(i);
+  CHECK(f.getNodeCount() == count + 1);
+}
+
+struct padded_trait : public async::traits {
+  static constexpr size_t NodeAlign = 64;
+};
+
+struct outofline_trait : public async::traits {
+  static constexpr bool OutOfLine = true;
+};
+
+TEST_CASE("queue: nodes padded to a cacheline") {
+  async::queue<int, padded_trait> q;
+  int v(0);
+  for (int i = 0; i < 1000; ++i)
+    q.enqueue(i);
+  for (int i = 0; i < 1000; ++i) {
+    CHECK(q.dequeue(v));
+    CHECK(v == i);
+  }
+  CHECK(q.dequeue(v) == false);
+}
+
+TEST_CASE("queue: elements stored out of line") {
+  async::queue<std::string, outofline_trait> q;
+  for (int i = 0; i < 1000; ++i)
+    q.enqueue(std::string(100, 'a') + std::to_string(i));
+  std::string s;
+  for (int i = 0; i < 500; ++i) {
+    CHECK(q.dequeue(s));
+    CHECK(s == std::string(100, 'a') + std::to_string(i));
+  }
+} // the strings left are freed with the queue
+
+#if ASYNC_HAS_DWCAS
+struct wide_trait : public async::traits {
+  static constexpr bool WideIndex = true;
+};
+
+TEST_CASE("queue: wide index") {
+  async::queue<int, wide_trait> q;
+  CHECK(q.is_lock_free_v());
+  int v(0);
+  for (int round = 0; round < 3; ++round) {
+    for (int i = 0; i < 1000; ++i)
+      q.enqueue(i);
+    for (int i = 0; i < 1000; ++i) {
+      CHECK(q.dequeue(v));
+      CHECK(v == i);
+    }
+    CHECK(q.dequeue(v) == false);
+    q.shrink_to_fit(); // revived with newer tags in the next round
+  }
+  std::vector<std::thread> threads;
+  std::atomic<int> sum(0);
+  for (int t = 0; t < 4; ++t)
+    threads.emplace_back([&]() {
+      int x(0);
+      for (int i = 0; i < 10000; ++i) {
+        q.enqueue(1);
+        while (!q.dequeue(x))
+          ;
+        sum += x;
+      }
+    });
+  for (auto &t : threads)
+    t.join();
+  CHECK(sum == 40000);
+}
+
+TEST_CASE("queue: wide index tag reuse") {
+  // a handful of nodes go round and round between the queue and the free
+  // list, so a preempted CAS meets its node again, with a newer tag
+  async::queue<int, wide_trait> q;
+  int const threads = 4, iteration = 50000;
+  std::vector<std::vector<int>> got(threads);
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; ++t)
+    workers.emplace_back([&, t]() {
+      int x(0);
+      for (int i = 0; i < iteration; ++i) {
+        q.enqueue(t * iteration + i);
+        while (!q.dequeue(x))
+          ;
+        got[t].push_back(x);
+      }
+    });
+  for (auto &w : workers)
+    w.join();
+  std::vector<int> seen(threads * iteration, 0);
+  for (auto &g : got)
+    for (auto x : g)
+      ++seen[x];
+  CHECK(std::count(seen.begin(), seen.end(), 1) == threads * iteration);
+  int x(0);
+  CHECK(!q.dequeue(x));
+}
+#endif
+
+struct narrowtag_trait : public async::traits {
+  static constexpr uint64_t Tagbits = 2; // tags 1, 2, 3, 1, ...
+  static constexpr uint64_t L3bits = 18;
+  static constexpr uint64_t L2bits = 18;
+  static constexpr uint64_t L1bits = 18;
+  static constexpr size_t MagazineSize = 0;
+};
+
+TEST_CASE("queue: tag wraparound") {
+  // the nodes wrap their tags around many times, a tag of 0 would make a
+  // queued node's null link the null link of the free list, which a stale
+  // producer could link to
+  async::queue<int, narrowtag_trait> q;
+  int v(0);
+  for (int round = 0; round < 1000; ++round) {
+    for (int i = 0; i < 5; ++i)
+      q.enqueue(round * 5 + i);
+    for (int i = 0; i < 5; ++i) {
+      CHECK(q.dequeue(v));
+      CHECK(v == round * 5 + i);
+    }
+    CHECK(!q.dequeue(v));
+  }
+  CHECK(q.getNodeCount() < 16); // the nodes were reused
+  for (int round = 0; round < 3; ++round) { // revived with wrapped tags
+    for (int i = 0; i < 1000; ++i)
+      q.enqueue(i);
+    for (int i = 0; i < 1000; ++i) {
+      CHECK(q.dequeue(v));
+      CHECK(v == i);
+    }
+    CHECK(!q.dequeue(v));
+    q.shrink_to_fit();
+  }
+}
+
 TEST_CASE("queue: bulk_enqueue ") {
   int a[] = {1, 2, 3, 4, 5};
   async::queue<int> q;
@@ -161,6 +588,26 @@ TEST_CASE("queue: bulk_dequeue 2") {
   CHECK(a[2] == 3);
 }
 
+TEST_CASE("queue: bulk_dequeue in batches") {
+  async::queue<int> q;
+  int v(0);
+  q.enqueue(-1);
+  q.dequeue(v); // consumed in place, its node is skipped by bulk_dequeue
+  for (int i = 0; i < 100; ++i)
+    q.enqueue(i);
+  auto nodes = q.getNodeCount();
+  std::vector<int> a;
+  for (size_t count = 1; count > 0;)
+    count = q.bulk_dequeue(std::back_inserter(a), 16);
+  REQUIRE(a.size() == 100);
+  for (int i = 0; i < 100; ++i)
+    CHECK(a[i] == i);
+  CHECK(q.dequeue(v) == false);
+  for (int i = 0; i < 100; ++i) // nodes were recycled
+    q.enqueue(i);
+  CHECK(q.getNodeCount() == nodes);
+}
+
 TEST_CASE("queue: multi-thread test") {
   const int iteration = 888;
   const int tcount = 5;
@@ -272,3 +719,138 @@ TEST_CASE("queue: multi-thread test with bulk operations") {
 
   CHECK(sum == iteration * (iteration - 1) / 2);
 }
+
+#if defined(__linux__)
+// a thread is preempted at a random point by parking it in a signal handler,
+// e.g. between linking its node and moving enqueueIx, or between moving
+// dequeueIx and taking the element
+static std::atomic<bool> parked(false), unparked(false);
+static void park(int) {
+  parked = true;
+  while (!unparked)
+    sched_yield();
+  parked = false;
+}
+
+TEST_CASE("queue: preempted producers and consumers") {
+  struct sigaction sa, old;
+  std::memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = park;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  REQUIRE(sigaction(SIGUSR1, &sa, &old) == 0);
+
+  async::queue<uint64_t> q;
+  int const producers = 3, consumers = 2;
+  std::atomic<bool> stop(false), produced(false), outoforder(false);
+  std::atomic<uint64_t> enqueued(0), dequeued(0), enqsum(0), deqsum(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < producers; ++t)
+    threads.emplace_back([&, t]() {
+      uint64_t seq(0), sum(0);
+      while (!stop) {
+        if (enqueued > dequeued + 10000) { // don't run away
+          std::this_thread::yield();
+          continue;
+        }
+        auto v = (static_cast<uint64_t>(t) << 32) | seq++;
+        q.enqueue(v);
+        sum += v;
+        ++enqueued;
+      }
+      enqsum += sum;
+    });
+  for (int t = 0; t < consumers; ++t)
+    threads.emplace_back([&]() {
+      std::vector<int64_t> last(producers, -1); // FIFO per producer
+      uint64_t v(0), sum(0);
+      for (;;) {
+        if (q.dequeue(v)) {
+          auto p = v >> 32;
+          auto seq = static_cast<int64_t>(v & 0xffffffff);
+          if (seq <= last[p])
+            outoforder = true;
+          last[p] = seq;
+          sum += v;
+          ++dequeued;
+        } else if (produced)
+          break;
+        else
+          std::this_thread::yield();
+      }
+      deqsum += sum;
+    });
+
+  // park each thread in turn, the others must keep enqueuing and dequeuing
+  for (int round = 0; round < 100; ++round) {
+    auto &victim = threads[round % threads.size()];
+    unparked = false;
+    REQUIRE(pthread_kill(victim.native_handle(), SIGUSR1) == 0);
+    while (!parked)
+      std::this_thread::yield();
+    auto enq = enqueued.load(), deq = dequeued.load();
+    auto deadline =
+        std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while ((enqueued < enq + 100 || dequeued < deq + 100) &&
+           std::chrono::steady_clock::now() < deadline)
+      std::this_thread::yield();
+    CHECK(enqueued >= enq + 100);
+    CHECK(dequeued >= deq + 100);
+    unparked = true;
+    while (parked)
+      std::this_thread::yield();
+  }
+  stop = true;
+  for (int t = 0; t < producers; ++t)
+    threads[t].join();
+  produced = true;
+  for (int t = producers; t < producers + consumers; ++t)
+    threads[t].join();
+  sigaction(SIGUSR1, &old, nullptr);
+
+  uint64_t v(0);
+  CHECK(!q.dequeue(v));
+  CHECK(!outoforder);
+  CHECK(enqueued == dequeued);
+  CHECK(enqsum == deqsum);
+}
+#endif
+
+struct waitable_trait : public async::traits {
+  static constexpr bool Waitable = true;
+};
+
+TEST_CASE("queue: wait and close") {
+  async::queue<int, waitable_trait> q;
+  int v(0);
+  CHECK(q.wait_dequeue_for(v, std::chrono::milliseconds(10)) ==
+        async::wait_status::timeout);
+  int const iteration = 10000;
+  std::atomic<int> sum(0);
+  std::vector<std::thread> consumers;
+  for (int t = 0; t < 3; ++t)
+    consumers.emplace_back([&]() {
+      int data(0), tsum(0);
+      while (q.wait_dequeue(data))
+        tsum += data;
+      sum += tsum;
+    });
+  std::thread producer([&]() {
+    for (int i = 0; i < iteration; ++i) {
+      q.enqueue(i);
+      if (i % 1000 == 0) // let the consumers fall asleep
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  });
+  producer.join();
+  q.close();
+  for (auto &c : consumers)
+    c.join();
+  CHECK(sum == iteration * (iteration - 1) / 2);
+  CHECK(q.wait_dequeue_for(v, std::chrono::seconds(1)) ==
+        async::wait_status::closed);
+  q.enqueue(1); // drained first
+  CHECK(q.wait_dequeue_for(v, std::chrono::seconds(1)) ==
+        async::wait_status::ready);
+  CHECK(v == 1);
+}
@@ -0,0 +1,144 @@
+/////////////////////////////////////////////////////////////////////
+//          Copyright Yibo Zhu 2017
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+/////////////////////////////////////////////////////////////////////
+#include "catch.hpp"
+#include "relaxed_priority_queue.h"
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+TEST_CASE("relaxed_priority_queue: single heap is strictly ordered") {
+  async::relaxed_priority_queue<int, std::string> q(1);
+  q.push(3, "c");
+  q.push(1, "a");
+  q.push(2, "b");
+  CHECK(q.size() == 3);
+  int k(0);
+  std::string v;
+  CHECK(q.try_pop(k, v) == true);
+  CHECK(k == 1);
+  CHECK(v == "a");
+  CHECK(q.try_pop(k, v) == true);
+  CHECK(k == 2);
+  CHECK(v == "b");
+  CHECK(q.try_pop(k, v) == true);
+  CHECK(k == 3);
+  CHECK(v == "c");
+  CHECK(q.try_pop(k, v) == false);
+  CHECK(q.empty());
+}
+
+TEST_CASE("relaxed_priority_queue: move only value") {
+  async::relaxed_priority_queue<long, std::unique_ptr<int>> q(4);
+  q.push(7, new int(7));
+  q.push(5, std::unique_ptr<int>(new int(5)));
+  long k(0);
+  std::unique_ptr<int> v;
+  int sum(0);
+  while (q.try_pop(k, v)) {
+    CHECK(*v == k);
+    sum += *v;
+  }
+  CHECK(sum == 12);
+}
+
+struct throwing_value {
+  throwing_value() : v(0) {}
+  explicit throwing_value(int i) : v(i) {
+    if (i < 0)
+      throw std::invalid_argument("negative");
+  }
+  int v;
+};
+
+TEST_CASE("relaxed_priority_queue: a throwing push leaves the heap unlocked") {
+  async::relaxed_priority_queue<int, throwing_value> q(1);
+  q.push(2, 2);
+  CHECK_THROWS_AS(q.push(1, -1), std::invalid_argument const &);
+  q.push(3, 3); // spins forever if the only heap stayed locked
+  int k(0);
+  throwing_value v;
+  CHECK(q.try_pop(k, v));
+  CHECK(v.v == 2);
+  CHECK(q.try_pop(k, v));
+  CHECK(v.v == 3);
+  CHECK(!q.try_pop(k, v));
+}
+
+TEST_CASE("relaxed_priority_queue: all entries are found with many heaps") {
+  async::relaxed_priority_queue<int, int> q(64);
+  for (int i = 0; i < 100; ++i)
+    q.push(i, i);
+  int k(0), v(0), count(0), sum(0);
+  while (q.try_pop(k, v)) {
+    CHECK(k == v);
+    ++count;
+    sum += v;
+  }
+  CHECK(count == 100);
+  CHECK(sum == 99 * 100 / 2);
+}
+
+TEST_CASE("relaxed_priority_queue: the largest key is a valid key") {
+  auto const largest = std::numeric_limits<long>::max();
+  for (size_t heaps : {1, 8}) {
+    async::relaxed_priority_queue<long, int> q(heaps);
+    q.push(largest, 1);
+    q.push(3, 2);
+    q.push(largest, 3);
+    long k(0);
+    int v(0), sum(0);
+    CHECK(q.try_pop(k, v));
+    if (heaps == 1)
+      CHECK(k == 3);
+    sum += v;
+    for (int i = 0; i < 2; ++i) {
+      CHECK(q.try_pop(k, v));
+      sum += v;
+    }
+    CHECK(sum == 6);
+    CHECK(!q.try_pop(k, v));
+    CHECK(q.empty());
+  }
+}
+
+TEST_CASE("relaxed_priority_queue: multi-thread test") {
+  const int iteration = 888;
+  const int tcount = 5;
+  async::relaxed_priority_queue<int, int> q(2 * tcount);
+  std::atomic<bool> start(false);
+  std::atomic<int> remaining(iteration);
+  std::atomic<int> sum(0);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < tcount; ++i) {
+    threads.push_back(std::thread([&, i]() {
+      for (; !start;)
+        ;
+      for (auto j = i; j < iteration; j += tcount)
+        q.push(j, j);
+    }));
+    threads.push_back(std::thread([&]() {
+      for (; !start;)
+        ;
+      int tsum(0), k(0), v(0);
+      while (remaining > 0) {
+        if (q.try_pop(k, v)) {
+          tsum += v;
+          --remaining;
+        }
+      }
+      sum += tsum;
+    }));
+  }
+  start = true;
+  for (auto &t : threads)
+    t.join();
+  CHECK(sum == iteration * (iteration - 1) / 2);
+}
@@ -0,0 +1,88 @@
+/////////////////////////////////////////////////////////////////////
+//          Copyright Yibo Zhu 2017
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+/////////////////////////////////////////////////////////////////////
+#include "resizable_bounded_queue.h"
+#include "catch.hpp"
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+TEST_CASE("resizable_bounded_queue: grow and shrink") {
+  async::resizable_bounded_queue<int> q(4);
+  int v(0);
+  for (int i = 0; i < 4; ++i)
+    CHECK(q.enqueue(i));
+  CHECK(!q.enqueue(4)); // full
+  q.resize(16);
+  CHECK(q.size() == 16);
+  for (int i = 4; i < 20; ++i)
+    CHECK(q.enqueue(i));
+  CHECK(!q.enqueue(20));
+  q.resize(2);
+  CHECK(q.enqueue(20));
+  CHECK(q.enqueue(21));
+  CHECK(!q.enqueue(22));
+  for (int i = 0; i < 22; ++i) { // in order, across the rings
+    CHECK(q.dequeue(v));
+    CHECK(v == i);
+  }
+  CHECK(!q.dequeue(v));
+  CHECK(q.enqueue(22));
+  CHECK(q.dequeue(v));
+  CHECK(v == 22);
+
+  async::resizable_bounded_queue<std::string> sq(2);
+  sq.enqueue("left in a sealed ring");
+  sq.resize(4);
+  sq.enqueue("left in the last ring");
+}
+
+TEST_CASE("resizable_bounded_queue: resize while in use") {
+  async::resizable_bounded_queue<int> q(8);
+  int const iteration = 20000;
+  int const producers = 2;
+  std::atomic<int> consumed(0);
+  std::atomic<bool> ordered(true);
+  std::atomic<int64_t> sum(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < producers; ++t)
+    threads.emplace_back([&, t]() {
+      for (int i = 0; i < iteration; ++i)
+        while (!q.enqueue(t * iteration + i))
+          std::this_thread::yield();
+    });
+  for (int t = 0; t < 2; ++t)
+    threads.emplace_back([&]() {
+      int last[producers] = {-1, -1};
+      int64_t tsum(0);
+      int v(0);
+      while (consumed.load() < iteration * producers) {
+        if (q.dequeue(v)) {
+          auto p = v / iteration;
+          if (v <= last[p]) // fifo per producer, seen by each consumer
+            ordered = false;
+          last[p] = v;
+          tsum += v;
+          ++consumed;
+        }
+      }
+      sum += tsum;
+    });
+  std::thread resizer([&]() {
+    size_t sizes[] = {64, 2, 1024, 16, 3, 256};
+    for (int i = 0; consumed.load() < iteration * producers; ++i) {
+      q.resize(sizes[i % 6]);
+      std::this_thread::yield();
+    }
+  });
+  for (auto &t : threads)
+    t.join();
+  resizer.join();
+  int64_t n = iteration * producers;
+  CHECK(sum == n * (n - 1) / 2);
+  CHECK(ordered);
+}
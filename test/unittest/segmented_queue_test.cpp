@@ -0,0 +1,99 @@
+/////////////////////////////////////////////////////////////////////
+//          Copyright Yibo Zhu 2017
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+/////////////////////////////////////////////////////////////////////
+#include "catch.hpp"
+#include "segmented_queue.h"
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct small_segment_trait : public async::segmented_traits {
+  static constexpr size_t SegmentSize = 4;
+};
+
+struct ThrowStruct_S {
+  ThrowStruct_S() {}
+  ThrowStruct_S(int i) {
+    if (i == 2)
+      throw i;
+  }
+  int value = 0;
+};
+
+TEST_CASE("segmented_queue: enque/deque in order") {
+  async::segmented_queue<int, small_segment_trait> q;
+  int v(0);
+  CHECK(q.dequeue(v) == false);
+  for (int i = 0; i < 10; ++i) // spans several segments
+    q.enqueue(i);
+  for (int i = 0; i < 10; ++i) {
+    CHECK(q.dequeue(v));
+    CHECK(v == i);
+  }
+  CHECK(q.dequeue(v) == false);
+  for (int i = 0; i < 10; ++i) // with recycled segments
+    q.enqueue(i);
+  for (int i = 0; i < 10; ++i) {
+    CHECK(q.dequeue(v));
+    CHECK(v == i);
+  }
+}
+
+TEST_CASE("segmented_queue: move constructor only type") {
+  async::segmented_queue<std::unique_ptr<int>, small_segment_trait> q;
+  q.enqueue(std::unique_ptr<int>(new int(1)));
+  q.enqueue(new int(2));
+  for (int i = 0; i < 10; ++i) // freed by the destructor
+    q.enqueue(new int(i));
+  std::unique_ptr<int> v;
+  CHECK(q.dequeue(v));
+  CHECK(*v == 1);
+  CHECK(q.dequeue(v));
+  CHECK(*v == 2);
+}
+
+TEST_CASE("segmented_queue: throwing constructor") {
+  async::segmented_queue<ThrowStruct_S> q;
+  q.enqueue(1);
+  CHECK_THROWS_AS(q.enqueue(2), int);
+  q.enqueue(3);
+  ThrowStruct_S t;
+  CHECK(q.dequeue(t));
+  CHECK(q.dequeue(t));
+  CHECK(q.dequeue(t) == false);
+}
+
+TEST_CASE("segmented_queue: multi-thread test") {
+  const int iteration = 20000;
+  const int tcount = 4;
+  async::segmented_queue<int, small_segment_trait> q;
+  std::vector<std::thread> threads;
+  std::atomic<int> remaining(iteration);
+  std::atomic<int64_t> sum(0);
+  for (int i = 0; i < tcount; ++i) {
+    threads.emplace_back([&, i]() {
+      for (auto j = i; j < iteration; j += tcount)
+        q.enqueue(j);
+    });
+    threads.emplace_back([&]() {
+      int64_t tsum(0);
+      int v(0);
+      while (remaining > 0) {
+        if (q.dequeue(v)) {
+          tsum += v;
+          --remaining;
+        } else {
+          std::this_thread::yield();
+        }
+      }
+      sum += tsum;
+    });
+  }
+  for (auto &t : threads)
+    t.join();
+  CHECK(sum == static_cast<int64_t>(iteration) * (iteration - 1) / 2);
+}
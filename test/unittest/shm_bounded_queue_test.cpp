@@ -0,0 +1,138 @@
+/////////////////////////////////////////////////////////////////////
+//          Copyright Yibo Zhu 2017
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+/////////////////////////////////////////////////////////////////////
+#if defined(__linux__)
+#include "shm_bounded_queue.h"
+#include "catch.hpp"
+#include <cerrno>
+#include <string>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+struct quote {
+  int id;
+  double price;
+};
+
+static std::string shmname() {
+  return "/async_shm_test_" + std::to_string(getpid());
+}
+
+// run f in a child process, which exits with 0 if f returned true
+template <typename F> static pid_t spawn(F &&f) {
+  auto pid = fork();
+  if (pid == 0)
+    _exit(f() ? 0 : 1);
+  return pid;
+}
+
+static int exitstatus(pid_t pid) {
+  int status(-1);
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+TEST_CASE("shm_bounded_queue: enque/deque in order") {
+  auto q = async::shm_bounded_queue<quote>::create(shmname(), 10);
+  CHECK(q.size() == 10);
+  quote v{0, 0};
+  CHECK(!q.dequeue(v));
+  for (int i = 0; i < 10; ++i)
+    CHECK(q.enqueue(quote{i, i * 0.5}));
+  CHECK(!q.enqueue(quote{10, 0}));
+  try { // the name is taken, not replaced
+    async::shm_bounded_queue<quote>::create(shmname(), 10);
+    CHECK(false);
+  } catch (std::system_error const &e) {
+    CHECK(e.code().value() == EEXIST);
+  }
+  // mapped again, at another address
+  auto other = async::shm_bounded_queue<quote>::attach(shmname());
+  CHECK(other.size() == 10);
+  for (int i = 0; i < 10; ++i) {
+    CHECK(other.dequeue(v));
+    CHECK(v.id == i);
+    CHECK(v.price == i * 0.5);
+  }
+  CHECK(!q.dequeue(v));
+  CHECK(async::shm_bounded_queue<quote>::unlink(shmname()));
+  CHECK(q.enqueue(quote{1, 1})); // still mapped
+  CHECK(other.dequeue(v));
+  CHECK_THROWS(async::shm_bounded_queue<quote>::attach(shmname()));
+}
+
+TEST_CASE("shm_bounded_queue: attach checks the header") {
+  auto q = async::shm_bounded_queue<quote>::create_anonymous(16);
+  CHECK_NOTHROW(async::shm_bounded_queue<quote>::attach(q.fd()));
+  CHECK_THROWS_AS(async::shm_bounded_queue<int>::attach(q.fd()),
+                  std::runtime_error const &);
+  auto fd = static_cast<int>(syscall(SYS_memfd_create, "not_a_queue", 0));
+  REQUIRE(fd >= 0);
+  REQUIRE(ftruncate(fd, 4096) == 0);
+  CHECK_THROWS_AS(async::shm_bounded_queue<quote>::attach(fd),
+                  std::runtime_error const &);
+  close(fd);
+
+  // the size is read once, a peer writing over the header afterwards can't
+  // send this process out of the ring
+  auto other = async::shm_bounded_queue<quote>::attach(q.fd());
+  auto hdr = static_cast<uint64_t *>(
+      mmap(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, q.fd(), 0));
+  REQUIRE(hdr != MAP_FAILED);
+  hdr[2] = uint64_t(1) << 40; // capacity, after the magic and the version
+  for (int i = 0; i < 16; ++i)
+    CHECK(other.enqueue(quote{i, 0}));
+  CHECK(!other.enqueue(quote{16, 0}));
+  CHECK(other.size() == 16);
+  CHECK_THROWS_AS(async::shm_bounded_queue<quote>::attach(q.fd()),
+                  std::runtime_error const &); // truncated
+  munmap(hdr, 4096);
+}
+
+TEST_CASE("shm_bounded_queue: across processes") {
+  auto name = shmname(); // the child's pid differs
+  auto q = async::shm_bounded_queue<quote>::create(name, 64);
+  int const iteration = 100000;
+  auto child = spawn([&]() {
+    auto cq = async::shm_bounded_queue<quote>::attach(name);
+    quote v{0, 0};
+    int expected(0);
+    while (cq.wait_dequeue(v))
+      if (v.id != expected++)
+        return false;
+    return expected == iteration;
+  });
+  std::thread producer([&]() {
+    for (int i = 0; i < iteration; ++i)
+      CHECK(q.wait_enqueue_for(std::chrono::seconds(10), quote{i, 1.0}) ==
+            async::wait_status::ready);
+    q.close();
+  });
+  producer.join();
+  CHECK(exitstatus(child) == 0);
+  async::shm_bounded_queue<quote>::unlink(name);
+
+  // the child produces into an inherited memfd
+  auto mq = async::shm_bounded_queue<int>::create_anonymous(8);
+  child = spawn([&]() {
+    auto cq = async::shm_bounded_queue<int>::attach(mq.fd());
+    for (int i = 0; i < iteration; ++i)
+      if (cq.wait_enqueue_for(std::chrono::seconds(10), i) !=
+          async::wait_status::ready)
+        return false;
+    cq.close();
+    return true;
+  });
+  int v(0);
+  long long sum(0);
+  while (mq.wait_dequeue(v))
+    sum += v;
+  CHECK(exitstatus(child) == 0);
+  CHECK(sum == static_cast<long long>(iteration) * (iteration - 1) / 2);
+}
+#endif
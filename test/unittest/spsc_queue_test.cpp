@@ -0,0 +1,68 @@
+/////////////////////////////////////////////////////////////////////
+//          Copyright Yibo Zhu 2017
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+/////////////////////////////////////////////////////////////////////
+#include "catch.hpp"
+#include "spsc_queue.h"
+#include <memory>
+#include <thread>
+
+TEST_CASE("spsc_queue: enque/deque in order") {
+  async::spsc_queue<int> q(3);
+  CHECK(q.empty());
+  q.enqueue(1);
+  q.enqueue(2);
+  q.enqueue(3);
+  CHECK(!q.empty());
+  int i(0);
+  q.dequeue(i);
+  CHECK(i == 1);
+  q.dequeue(i);
+  CHECK(i == 2);
+  q.dequeue(i);
+  CHECK(i == 3);
+  CHECK(q.empty());
+}
+
+TEST_CASE("spsc_queue: queue full and empty test") {
+  async::spsc_queue<std::unique_ptr<int>> q(2);
+  CHECK(q.enqueue(new int(1)) == true);
+  CHECK(q.enqueue(new int(2)) == true);
+  CHECK(q.enqueue(new int(3)) == false);
+  std::unique_ptr<int> d;
+  CHECK(q.dequeue(d) == true);
+  CHECK(*d == 1);
+  CHECK(q.enqueue(new int(3)) == true);
+  CHECK(q.dequeue(d) == true);
+  CHECK(*d == 2);
+  CHECK(q.dequeue(d) == true);
+  CHECK(*d == 3);
+  CHECK(q.dequeue(d) == false);
+  q.enqueue(new int(4)); // left in queue, freed by destructor
+}
+
+TEST_CASE("spsc_queue: producer and consumer threads") {
+  async::spsc_queue<uint64_t> q(64);
+  uint64_t const count = 100000;
+  std::thread producer([&]() {
+    for (uint64_t i = 0; i < count;)
+      if (q.enqueue(i))
+        ++i;
+      else
+        std::this_thread::yield();
+  });
+  bool inorder(true);
+  for (uint64_t i = 0, v = 0; i < count;) {
+    if (q.dequeue(v)) {
+      inorder = inorder && v == i;
+      ++i;
+    } else {
+      std::this_thread::yield();
+    }
+  }
+  producer.join();
+  CHECK(inorder);
+  CHECK(q.empty());
+}
@@ -6,8 +6,10 @@
 /////////////////////////////////////////////////////////////////////
 #include "catch.hpp"
 #include "threadpool.h"
+#include <algorithm>
 #include <chrono>
 #include <iostream>
+#include <vector>
 void noop() {}
 
 int sum(int i, int j) { return i + j; }
@@ -92,4 +94,189 @@ TEST_CASE("threadpool post class member function") {
       "class member function post task with calling another member function") {
     CHECK(a.postsum(11, 22) == 33);
   }
-}
\ No newline at end of file
+}
+TEST_CASE("threadpool post_with_deadline") {
+  async::threadpool tp(2);
+  auto deadline =
+      async::threadpool::deadline_clock::now() + std::chrono::seconds(10);
+  SECTION("task meets its deadline") {
+    auto rel = tp.post_with_deadline(deadline, sum, 11, 31);
+    CHECK(rel.get() == 42);
+  }
+  SECTION("lambda meets its deadline") {
+    auto rel = tp.post_with_deadline(deadline, []() { return 42; });
+    CHECK(rel.get() == 42);
+  }
+}
+
+TEST_CASE("threadpool post_with_deadline drops expired task") {
+  async::threadpool tp(1);
+  std::atomic<int> expired(0);
+  tp.set_expired_handler(
+      [&](async::threadpool::deadline_clock::time_point) { ++expired; });
+  std::atomic<bool> started(false), release(false);
+  auto blocker = tp.post([&]() {
+    started = true;
+    for (; !release;)
+      std::this_thread::yield();
+  });
+  for (; !started;)
+    std::this_thread::yield();
+  auto now = async::threadpool::deadline_clock::now();
+  auto missed = tp.post_with_deadline(now + std::chrono::milliseconds(1),
+                                      []() { return 1; });
+  auto met = tp.post_with_deadline(now + std::chrono::seconds(10),
+                                   []() { return 2; });
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  release = true;
+  blocker.get();
+  CHECK(met.get() == 2);
+  CHECK_THROWS_AS(missed.get(), std::future_error const &);
+  CHECK(expired == 1);
+}
+
+TEST_CASE("threadpool post_with_deadline at the end of time") {
+  async::threadpool tp(1);
+  auto never = tp.post_with_deadline(
+      async::threadpool::deadline_clock::time_point::max(),
+      []() { return 42; });
+  CHECK(never.get() == 42);
+}
+
+TEST_CASE("threadpool deadline tasks don't starve posted tasks") {
+  async::threadpool tp(1);
+  std::atomic<bool> started(false), release(false);
+  auto blocker = tp.post([&]() {
+    started = true;
+    for (; !release;)
+      std::this_thread::yield();
+  });
+  for (; !started;)
+    std::this_thread::yield();
+  auto deadline =
+      async::threadpool::deadline_clock::now() + std::chrono::seconds(60);
+  int const deadlines = 1000;
+  std::atomic<int> ran(0);
+  std::vector<std::future<void>> futures;
+  for (int i = 0; i < deadlines; ++i)
+    futures.push_back(tp.post_with_deadline(deadline, [&]() { ++ran; }));
+  auto posted = tp.post([&]() { return ran.load(); });
+  release = true;
+  blocker.get();
+  CHECK(posted.get() < deadlines); // let in before the deadlines ran out
+  for (auto &f : futures)
+    f.get();
+  CHECK(ran == deadlines);
+}
+
+TEST_CASE("threadpool tenants share workers fairly") {
+  async::threadpool tp(1);
+  auto heavy = tp.addtenant(3);
+  auto light = tp.addtenant(1);
+  std::atomic<bool> started(false), release(false);
+  auto blocker = tp.post([&]() {
+    started = true;
+    for (; !release;)
+      std::this_thread::yield();
+  });
+  for (; !started;)
+    std::this_thread::yield();
+  std::vector<size_t> order; // only touched by the single worker
+  std::vector<std::future<void>> rels;
+  for (int i = 0; i < 40; ++i) {
+    rels.push_back(
+        tp.post_for_tenant(heavy, [&, heavy]() { order.push_back(heavy); }));
+    rels.push_back(
+        tp.post_for_tenant(light, [&, light]() { order.push_back(light); }));
+  }
+  release = true;
+  blocker.get();
+  for (auto &rel : rels)
+    rel.get();
+  REQUIRE(order.size() == 80);
+  auto heavycount = std::count(order.begin(), order.begin() + 40, heavy);
+  CHECK(heavycount >= 25); // ~3:1 while both have tasks pending
+  CHECK(heavycount <= 35);
+
+  auto hm = tp.tenantmetrics(heavy);
+  auto lm = tp.tenantmetrics(light);
+  CHECK(hm.weight == 3);
+  CHECK(hm.submitted == 40);
+  CHECK(hm.executed == 40);
+  CHECK(lm.executed == 40);
+  CHECK(hm.share + lm.share + tp.tenantmetrics(0).share == Approx(1.0));
+  CHECK_THROWS_AS(tp.post_for_tenant(42, noop), std::out_of_range const &);
+}
+
+TEST_CASE("threadpool metrics span the first addtenant") {
+  async::threadpool tp(1);
+  std::promise<void> gate;
+  auto blocker = gate.get_future().share();
+  auto first = tp.post([blocker]() { blocker.wait(); });
+  auto queued = tp.post(noop); // posted alone, runs with a tenant registered
+  auto id = tp.addtenant();
+  gate.set_value();
+  first.get();
+  queued.get();
+  tp.post_for_tenant(id, noop).get();
+  auto m = tp.tenantmetrics(0);
+  CHECK(m.submitted == 2);
+  CHECK(m.executed == 2);
+  CHECK(tp.tenantmetrics(id).submitted == 1);
+  CHECK(tp.tenantmetrics(id).executed == 1);
+}
+
+TEST_CASE("threadpool worker runs its own follow-up tasks") {
+  async::threadpool tp(4);
+  std::atomic<int> samethread(0);
+  std::promise<void> done;
+  std::function<void(int, std::thread::id)> chain;
+  chain = [&](int left, std::thread::id parent) {
+    if (std::this_thread::get_id() == parent)
+      ++samethread;
+    if (left == 0) {
+      done.set_value();
+      return;
+    }
+    tp.post(chain, left - 1, std::this_thread::get_id());
+  };
+  tp.post(chain, 100, std::thread::id());
+  done.get_future().get();
+  CHECK(samethread >= 90); // a few may be taken over by idle workers
+}
+
+TEST_CASE("threadpool rescues tasks of a blocked worker") {
+  async::threadpool tp(2);
+  auto parent = tp.post([&]() {
+    auto child = tp.post([]() { return 42; }); // lands in local slot
+    return child.get(); // blocks until an idle worker takes it over
+  });
+  CHECK(parent.get() == 42);
+}
+
+TEST_CASE("threadpool tasks block on the futures of their children") {
+  async::threadpool tp(3); // a worker stays idle to take the children over
+  for (int round = 0; round < 4; ++round) {
+    std::vector<std::future<int>> parents;
+    for (int i = 0; i < 2; ++i)
+      parents.push_back(tp.post([&tp, i]() {
+        auto child = tp.post([i]() { return i; }); // wakes up an idle worker
+        return child.get();
+      }));
+    for (int i = 0; i < 2; ++i) {
+      REQUIRE(parents[i].wait_for(std::chrono::seconds(10)) ==
+              std::future_status::ready);
+      CHECK(parents[i].get() == i);
+    }
+  }
+}
+
+TEST_CASE("threadpool execute") {
+  async::threadpool tp(2);
+  std::promise<int> done;
+  tp.execute([&done]() { done.set_value(7); });
+  CHECK(done.get_future().get() == 7);
+  std::promise<int> deferred;
+  tp.defer([&deferred]() { deferred.set_value(8); });
+  CHECK(deferred.get_future().get() == 8);
+}
@@ -0,0 +1,42 @@
+/////////////////////////////////////////////////////////////////////
+//          Copyright Yibo Zhu 2017
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+/////////////////////////////////////////////////////////////////////
+#include "catch.hpp"
+#include "vmem.h"
+#include <cstring>
+
+TEST_CASE("vmem: page size") {
+  auto page = async::vmem::page_size();
+  CHECK(page > 0);
+  CHECK((page & (page - 1)) == 0);
+  CHECK(async::vmem::round_up(1) == page);
+  CHECK(async::vmem::round_up(page) == page);
+  CHECK(async::vmem::round_up(page + 1) == 2 * page);
+}
+
+TEST_CASE("vmem: reserve and commit") {
+  auto page = async::vmem::page_size();
+  auto ptr = static_cast<char *>(async::vmem::reserve(4 * page));
+  REQUIRE(ptr != nullptr);
+  CHECK(async::vmem::commit(ptr + page, page));
+  std::memset(ptr + page, 1, page);
+  CHECK(ptr[page] == 1);
+  async::vmem::decommit(ptr + page, page);
+  async::vmem::release(ptr, 4 * page);
+}
+
+TEST_CASE("vmem: discarded pages stay accessible") {
+  auto page = async::vmem::page_size();
+  auto ptr = static_cast<char *>(async::vmem::allocate(2 * page));
+  CHECK(reinterpret_cast<uintptr_t>(ptr) % page == 0);
+  std::memset(ptr, 0, 2 * page);
+  ptr[0] = 1;
+  CHECK(async::vmem::discard(ptr, page));
+  CHECK((ptr[0] == 0 || ptr[0] == 1)); // kept or zero-filled
+  ptr[0] = 2;
+  CHECK(ptr[0] == 2);
+  async::vmem::deallocate(ptr, 2 * page);
+}